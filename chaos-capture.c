@@ -0,0 +1,229 @@
+/* Packet capture.
+
+   With CHAOS_CAPTURE set to a file name prefix, every packet sent or
+   received through the library is recorded in a ring buffer in
+   memory, keeping the last CHAOS_CAPTURE_SLOTS packets (default
+   4096) with up to CAPTURE_SNAP bytes of data each.  The ring is
+   written to prefix.pid.pcap at exit, and whenever the process gets
+   SIGUSR2, so a stuck transfer can be inspected while it's stuck.
+
+   The pcap link type is LINKTYPE_CHAOS.  The packets have a Chaos
+   header made up from what the NCP socket protocols show: opcode and
+   length are real, host addresses are zero, the socket descriptor is
+   in the source index for sent packets and the destination index
+   for received ones, and the packet number counts captured packets.
+
+   Recording a packet claims a slot with an atomic increment and
+   takes no lock.  A slot's sequence number is written last, so the
+   dump skips slots that are being filled in. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "chaos.h"
+#include "ncp.h"
+
+#define CAPTURE_SNAP  128
+#define LINKTYPE_CHAOS 5
+
+struct slot {
+  unsigned long seq;
+  long long usec;
+  unsigned short fd;
+  unsigned char sent;
+  unsigned char opcode;
+  unsigned short len;
+  unsigned short caplen;
+  unsigned char data[CAPTURE_SNAP];
+};
+
+struct pcap_header {
+  unsigned int magic;
+  unsigned short major, minor;
+  int zone;
+  unsigned int sigfigs, snaplen, network;
+};
+
+struct pcap_record {
+  unsigned int sec, usec, caplen, len;
+};
+
+int chaos_capturing = -1;
+static struct slot *ring;
+static unsigned long slots;
+static unsigned long head;
+static const char *prefix;
+static struct sigaction previous;
+
+static void dump_signal(int sig)
+{
+  int saved = errno;
+  chaos_capture_dump();
+  /* Statistics may want the signal too. */
+  if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+    previous.sa_handler(sig);
+  errno = saved;
+}
+
+/* Called on the first packet to see if capture is wanted. */
+static int capture_init(void)
+{
+  struct sigaction sa;
+  const char *p;
+  unsigned long n = 4096;
+
+  prefix = getenv("CHAOS_CAPTURE");
+  if (prefix == NULL || *prefix == 0)
+    return chaos_capturing = 0;
+
+  p = getenv("CHAOS_CAPTURE_SLOTS");
+  if (p != NULL && atol(p) > 0)
+    n = atol(p);
+  /* Round up to a power of two, so the index is a mask. */
+  for (slots = 1; slots < n; slots <<= 1)
+    ;
+  ring = calloc(slots, sizeof *ring);
+  if (ring == NULL)
+    return chaos_capturing = 0;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = dump_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, &previous);
+  atexit(chaos_capture_dump);
+  return chaos_capturing = 1;
+}
+
+void chaos_capture(int fd, int sent, int opcode,
+                   const struct iovec *iov, int iovcnt)
+{
+  struct timespec ts;
+  unsigned long seq;
+  struct slot *s;
+  size_t n, len = 0;
+  int i;
+
+  if (chaos_capturing < 0 && !capture_init())
+    return;
+
+  seq = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+  s = &ring[seq & (slots - 1)];
+  __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  s->usec = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  s->fd = fd;
+  s->sent = sent;
+  s->opcode = opcode;
+  for (i = 0; i < iovcnt; i++) {
+    n = iov[i].iov_len;
+    if (len < CAPTURE_SNAP)
+      memcpy(s->data + len, iov[i].iov_base,
+             n < CAPTURE_SNAP - len ? n : CAPTURE_SNAP - len);
+    len += n;
+  }
+  s->len = len;
+  s->caplen = len < CAPTURE_SNAP ? len : CAPTURE_SNAP;
+
+  __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void chaos_capture_data(int fd, int sent, int opcode,
+                        const void *data, size_t len)
+{
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  chaos_capture(fd, sent, opcode, &iov, 1);
+}
+
+static void put16(unsigned char *p, unsigned x)
+{
+  p[0] = (x >> 8) & 0xFF;
+  p[1] = x & 0xFF;
+}
+
+/* Make the file name without stdio, since this may run in a signal
+   handler. */
+static void file_name(char *name, size_t size)
+{
+  char digits[20];
+  size_t n = strlen(prefix);
+  int pid = getpid(), i = 0;
+
+  if (n > size - 30)
+    n = size - 30;
+  memcpy(name, prefix, n);
+  name[n++] = '.';
+  do
+    digits[i++] = '0' + pid % 10;
+  while ((pid /= 10) > 0);
+  while (i > 0)
+    name[n++] = digits[--i];
+  memcpy(name + n, ".pcap", 6);
+}
+
+/* Write the ring to the capture file. */
+void chaos_capture_dump(void)
+{
+  unsigned char packet[CHAOS_HEADER + CAPTURE_SNAP];
+  struct pcap_header file;
+  struct pcap_record rec;
+  unsigned long i, end, seq;
+  struct slot s;
+  char name[1024];
+  int fd;
+
+  if (chaos_capturing <= 0)
+    return;
+
+  file_name(name, sizeof name);
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+
+  file.magic = 0xa1b2c3d4;
+  file.major = 2;
+  file.minor = 4;
+  file.zone = 0;
+  file.sigfigs = 0;
+  file.snaplen = CHAOS_HEADER + CAPTURE_SNAP;
+  file.network = LINKTYPE_CHAOS;
+  if (write(fd, &file, sizeof file) != sizeof file)
+    goto done;
+
+  end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  i = end > slots ? end - slots : 0;
+  for (; i < end; i++) {
+    seq = __atomic_load_n(&ring[i & (slots - 1)].seq, __ATOMIC_ACQUIRE);
+    if (seq != i + 1)
+      continue;
+    s = ring[i & (slots - 1)];
+    if (__atomic_load_n(&ring[i & (slots - 1)].seq, __ATOMIC_ACQUIRE) != seq)
+      continue;
+
+    memset(packet, 0, CHAOS_HEADER);
+    packet[0] = s.opcode;
+    put16(packet + 2, s.len & 07777);
+    put16(packet + (s.sent ? 10 : 6), s.fd);
+    put16(packet + 12, i);
+    memcpy(packet + CHAOS_HEADER, s.data, s.caplen);
+
+    rec.sec = s.usec / 1000000;
+    rec.usec = s.usec % 1000000;
+    rec.caplen = CHAOS_HEADER + s.caplen;
+    rec.len = CHAOS_HEADER + s.len;
+    if (write(fd, &rec, sizeof rec) != sizeof rec
+        || write(fd, packet, rec.caplen) != (ssize_t)rec.caplen)
+      break;
+  }
+
+ done:
+  close(fd);
+}
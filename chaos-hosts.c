@@ -0,0 +1,362 @@
+/* Client-side cache of Chaosnet host addresses.
+
+   Host names given to chaos_stream_rfc and friends are translated to
+   numeric addresses before going into the RFC line, so that the NCP
+   doesn't have to look them up again for every connection.  The
+   cache is a text file shared by all processes of a user, with one
+   entry per line: name, octal address or "-" for a name known not to
+   exist, and expiry time.  Names not in the cache are looked up in a
+   local hosts file, and then by asking a HOSTAB server.
+
+   chaos_host_resolve may wait for a HOSTAB server, so it's only used
+   by the blocking calls.  chaos_rfc_start uses chaos_host_cached,
+   which only reads the cache and the hosts file.
+
+   The cache is only used if it's a plain file owned by the user and
+   not writable by anyone else, so that no one else can redirect
+   connections by adding entries to it.
+
+   Environment variables:
+     CHAOS_HOST_CACHE  Cache file, default chaos_hosts in
+                       $XDG_RUNTIME_DIR, or else /tmp/chaos-UID/hosts.
+     CHAOS_HOSTS       Hosts file, default /etc/chaos-hosts.  Each
+                       line has an octal address followed by names.
+     CHAOS_HOSTAB      Comma-separated list of HOSTAB servers.
+     CHAOS_HOST_TTL    Seconds to keep an entry, default 3600.  Names
+                       that don't exist are kept a tenth of that.
+
+   If neither a hosts file nor a HOSTAB server is available, names
+   are passed through to the NCP unchanged. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "chaos.h"
+
+/* Rewrite the cache file without stale entries when it grows past
+   this size. */
+#define MAX_CACHE_SIZE 65536
+
+#define HOSTAB_TIMEOUT 2000
+
+static struct chaos_host_stats stats;
+static int enabled = -1;
+static __thread int resolving;
+
+#define COUNT(x) __atomic_fetch_add(&stats.x, 1, __ATOMIC_RELAXED)
+
+static const char *env(const char *name, const char *value)
+{
+  const char *x = getenv(name);
+  return x != NULL ? x : value;
+}
+
+/* The cache file, or NULL if there's no private place for it. */
+static const char *cache_file(void)
+{
+  static char name[300];
+  char path[300];
+  const char *dir;
+  struct stat st;
+
+  if (getenv("CHAOS_HOST_CACHE") != NULL)
+    return getenv("CHAOS_HOST_CACHE");
+  if (name[0] != 0)
+    return name;
+
+  dir = getenv("XDG_RUNTIME_DIR");
+  if (dir != NULL && *dir == '/')
+    snprintf(path, sizeof path, "%s/chaos_hosts", dir);
+  else {
+    snprintf(path, sizeof path, "/tmp/chaos-%d", (int)geteuid());
+    mkdir(path, 0700);
+    if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & 077) != 0)
+      return NULL;
+    strcat(path, "/hosts");
+  }
+  memcpy(name, path, sizeof name);
+  return name;
+}
+
+/* Open the cache file, if it can be trusted. */
+static FILE *cache_open(int flags, const char *mode)
+{
+  const char *name = cache_file();
+  struct stat st;
+  FILE *f;
+  int fd;
+
+  if (name == NULL)
+    return NULL;
+  fd = open(name, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+      || st.st_uid != geteuid() || (st.st_mode & 022) != 0) {
+    close(fd);
+    return NULL;
+  }
+  f = fdopen(fd, mode);
+  if (f == NULL)
+    close(fd);
+  return f;
+}
+
+static const char *hosts_file(void)
+{
+  return env("CHAOS_HOSTS", "/etc/chaos-hosts");
+}
+
+static int ttl(void)
+{
+  return atoi(env("CHAOS_HOST_TTL", "3600"));
+}
+
+static int numeric(const char *host)
+{
+  if (*host == 0)
+    return 0;
+  for (; *host; host++) {
+    if (*host < '0' || *host > '7')
+      return 0;
+  }
+  return 1;
+}
+
+/* Look up name in the cache file.  Returns the address, 0 for a
+   negative entry, or -1 if not found.  With wait zero, a cache that's
+   being written counts as not found. */
+static int cache_lookup(const char *name, int wait)
+{
+  char line[200], host[100], address[20];
+  long long expires;
+  time_t now = time(NULL);
+  int result = -1;
+  FILE *f;
+
+  f = cache_open(O_RDONLY, "r");
+  if (f == NULL)
+    return -1;
+  if (flock(fileno(f), LOCK_SH | (wait ? 0 : LOCK_NB)) < 0) {
+    fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof line, f) != NULL) {
+    if (sscanf(line, "%99s %19s %lld", host, address, &expires) != 3)
+      continue;
+    if (expires < now || strcasecmp(host, name) != 0)
+      continue;
+    result = address[0] == '-' ? 0 : (int)strtol(address, NULL, 8);
+  }
+  fclose(f);
+  return result;
+}
+
+/* Drop expired entries.  The file is rewritten in place under the
+   lock that the caller holds, since others may have it open to
+   append to. */
+static void cache_compact(FILE *f, size_t size)
+{
+  char line[200], host[100], address[20], *kept;
+  long long expires;
+  time_t now = time(NULL);
+  size_t n = 0, len;
+
+  kept = malloc(size);
+  if (kept == NULL)
+    return;
+  rewind(f);
+  while (fgets(line, sizeof line, f) != NULL) {
+    len = strlen(line);
+    if (n + len <= size
+        && sscanf(line, "%99s %19s %lld", host, address, &expires) == 3
+        && expires >= now) {
+      memcpy(kept + n, line, len);
+      n += len;
+    }
+  }
+  if (ftruncate(fileno(f), 0) == 0) {
+    rewind(f);
+    fwrite(kept, 1, n, f);
+  }
+  free(kept);
+}
+
+static void cache_store(const char *name, int address, int seconds)
+{
+  struct stat st;
+  FILE *f;
+
+  f = cache_open(O_RDWR | O_CREAT | O_APPEND, "a+");
+  if (f == NULL)
+    return;
+  flock(fileno(f), LOCK_EX);
+  if (address > 0)
+    fprintf(f, "%s %o %lld\n", name, address,
+            (long long)time(NULL) + seconds);
+  else
+    fprintf(f, "%s - %lld\n", name, (long long)time(NULL) + seconds);
+  fflush(f);
+  if (fstat(fileno(f), &st) == 0 && st.st_size > MAX_CACHE_SIZE)
+    cache_compact(f, st.st_size);
+  fclose(f);
+}
+
+/* Look up name in the hosts file.  Returns the address, or -1. */
+static int file_lookup(const char *name)
+{
+  char line[500], *p, *word;
+  int address, result = -1;
+  FILE *f;
+
+  f = fopen(hosts_file(), "r");
+  if (f == NULL)
+    return -1;
+  while (result < 0 && fgets(line, sizeof line, f) != NULL) {
+    p = strchr(line, '#');
+    if (p != NULL)
+      *p = 0;
+    word = strtok(line, " \t\r\n");
+    if (word == NULL || !numeric(word))
+      continue;
+    address = strtol(word, NULL, 8);
+    while ((word = strtok(NULL, " \t\r\n")) != NULL) {
+      if (strcasecmp(word, name) == 0) {
+        result = address;
+        break;
+      }
+    }
+  }
+  fclose(f);
+  return result;
+}
+
+/* Ask a HOSTAB server.  The reply is a number of lines like
+   "CHAOS 3150", or a line starting with ERROR if there is no such
+   host.  Returns the address, 0 if the server says the name doesn't
+   exist, or -1 if no answer was had. */
+static int hostab_lookup(const char *name)
+{
+  const char *hosts[CHAOS_MAX_HOSTS + 1];
+  char list[200], reply[1000], *line;
+  ssize_t n;
+  size_t m = 0;
+  int fd, result = -1;
+
+  if (getenv("CHAOS_HOSTAB") == NULL)
+    return -1;
+  COUNT(queries);
+  strncpy(list, getenv("CHAOS_HOSTAB"), sizeof list - 1);
+  list[sizeof list - 1] = 0;
+  if (chaos_host_list(list, hosts, CHAOS_MAX_HOSTS + 1) < 0)
+    return -1;
+
+  fd = chaos_stream_rfc_any(hosts, "HOSTAB", NULL, 0, HOSTAB_TIMEOUT,
+                            CHAOS_RFC_STAGGER, NULL);
+  if (fd < 0)
+    return -1;
+  dprintf(fd, "%s\r\n", name);
+  while (m < sizeof reply - 1) {
+    n = read(fd, reply + m, sizeof reply - 1 - m);
+    if (n <= 0)
+      break;
+    m += n;
+    reply[m] = 0;
+    if (strstr(reply, "\n\n") != NULL || strstr(reply, "\n\r\n") != NULL)
+      break;
+  }
+  close(fd);
+  reply[m] = 0;
+
+  for (line = strtok(reply, "\r\n\215"); line != NULL;
+       line = strtok(NULL, "\r\n\215")) {
+    if (strncasecmp(line, "ERROR", 5) == 0)
+      return 0;
+    if (strncasecmp(line, "CHAOS ", 6) == 0 && result < 0)
+      result = strtol(line + 6, NULL, 8);
+  }
+  return result;
+}
+
+static int cache_enabled(void)
+{
+  if (enabled < 0)
+    enabled = getenv("CHAOS_HOSTAB") != NULL
+      || access(hosts_file(), R_OK) == 0;
+  return enabled;
+}
+
+/* Add an entry to the cache, e.g. from a broadcast scan. */
+void chaos_host_cache_add(const char *name, int address)
+{
+  cache_store(name, address, ttl());
+}
+
+static const char *lookup(const char *host, char *buffer, size_t size,
+                          int wait)
+{
+  int address;
+
+  if (numeric(host) || resolving || !cache_enabled()
+      || strlen(host) >= 100 || strpbrk(host, " \t\r\n") != NULL)
+    return host;
+
+  address = cache_lookup(host, wait);
+  if (address >= 0) {
+    if (address == 0) {
+      COUNT(negative);
+      return host;
+    }
+    COUNT(hits);
+    snprintf(buffer, size, "%o", address);
+    return buffer;
+  }
+
+  COUNT(misses);
+  address = file_lookup(host);
+  if (address < 0 && wait) {
+    resolving = 1;
+    address = hostab_lookup(host);
+    resolving = 0;
+  }
+  if (address < 0)
+    return host;
+
+  if (wait)
+    cache_store(host, address, address > 0 ? ttl() : ttl() / 10);
+  if (address == 0)
+    return host;
+  snprintf(buffer, size, "%o", address);
+  return buffer;
+}
+
+/* Translate a host name to a numeric address in buffer.  If the name
+   is not known, it's returned unchanged for the NCP to resolve. */
+const char *chaos_host_resolve(const char *host, char *buffer, size_t size)
+{
+  return lookup(host, buffer, size, 1);
+}
+
+/* The same, without waiting: only the cache and the hosts file are
+   looked at. */
+const char *chaos_host_cached(const char *host, char *buffer, size_t size)
+{
+  return lookup(host, buffer, size, 0);
+}
+
+void chaos_host_cache_stats(struct chaos_host_stats *x)
+{
+  x->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+  x->negative = __atomic_load_n(&stats.negative, __ATOMIC_RELAXED);
+  x->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+  x->queries = __atomic_load_n(&stats.queries, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,39 @@
+/* Static tracepoints.
+
+   CHAOS_PROBEn(name, ...) marks a USDT probe in the "chaos"
+   provider, which bpftrace, perf, or SystemTap can attach to in a
+   running process.  A probe is a nop instruction and a note in the
+   ELF file, so it costs next to nothing when nothing is attached.
+
+   The probes need <sys/sdt.h>, from the systemtap-sdt-dev or
+   systemtap-sdt-devel package.  Without it, or with CHAOS_NO_PROBES
+   defined, the probes compile to nothing.
+
+   By convention the first argument is the connection: the NCP
+   socket descriptor, or the TCP socket in the gateway. */
+
+#ifndef CHAOS_PROBE_H
+#define CHAOS_PROBE_H
+
+#if !defined(CHAOS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CHAOS_PROBES 1
+#endif
+#endif
+
+#ifdef CHAOS_PROBES
+#define CHAOS_PROBE0(name) DTRACE_PROBE(chaos, name)
+#define CHAOS_PROBE1(name, a) DTRACE_PROBE1(chaos, name, a)
+#define CHAOS_PROBE2(name, a, b) DTRACE_PROBE2(chaos, name, a, b)
+#define CHAOS_PROBE3(name, a, b, c) DTRACE_PROBE3(chaos, name, a, b, c)
+#define CHAOS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(chaos, name, a, b, c, d)
+#else
+#define CHAOS_PROBE0(name) do {} while (0)
+#define CHAOS_PROBE1(name, a) do {} while (0)
+#define CHAOS_PROBE2(name, a, b) do {} while (0)
+#define CHAOS_PROBE3(name, a, b, c) do {} while (0)
+#define CHAOS_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif /* CHAOS_PROBE_H */
@@ -0,0 +1,299 @@
+/* Find hosts with a broadcast.
+
+   Sends a BRD for STATUS, or any other contact, to a set of subnets
+   and collects the ANS replies until a deadline.  Each -s option is
+   a separate BRD, and they all go out at once, so a sweep takes
+   about one round trip however many hosts answer.  The replies are
+   merged by host address and printed as a table.  With -c, the names
+   hosts give in their STATUS replies go into the host cache, except
+   those with spaces in them, like "MIT AI", which can't be looked
+   up. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "chaos.h"
+
+#define MAX_SCANS   16
+#define MAX_ANSWERS 1024
+#define STATUS_NAME 32   /* Host name at the start of a STATUS reply. */
+
+struct scan {
+  int fd;
+  const char *subnets;
+  size_t len;
+  char buffer[4096];
+};
+
+struct answer {
+  unsigned address;
+  long long ms;
+  size_t len;
+  unsigned char data[CHAOS_MAX_DATA];
+};
+
+static struct scan scan[MAX_SCANS];
+static int scans;
+static struct answer answer[MAX_ANSWERS];
+static int answers;
+static long long started;
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-c] [-s subnets]... [-t ms] "
+          "[contact [args]]\n", name);
+  fprintf(stderr, "  -c    Put the host names from STATUS in the host cache.\n");
+  fprintf(stderr, "  -s S  Comma-separated octal subnets, or all.\n");
+  fprintf(stderr, "  -t N  Milliseconds to wait for replies, default 2000.\n");
+  exit(1);
+}
+
+static void start(struct scan *s, const char *contact, const char *args)
+{
+  char line[MAX_PACKET + 16];
+  int n;
+
+  s->len = 0;
+  s->fd = chaos_stream();
+  if (s->fd < 0) {
+    fprintf(stderr, "Error connecting to Chaosnet NCP: %s\n",
+            strerror(errno));
+    exit(1);
+  }
+  n = snprintf(line, sizeof line, "BRD %s %s%s%s\r\n", s->subnets,
+               contact, *args ? " " : "", args);
+  if (n < 0 || (size_t)n >= sizeof line) {
+    fprintf(stderr, "Contact and arguments too long\n");
+    exit(1);
+  }
+  if (write(s->fd, line, n) != n) {
+    fprintf(stderr, "Error sending BRD: %s\n", strerror(errno));
+    exit(1);
+  }
+  fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void stop(struct scan *s)
+{
+  close(s->fd);
+  s->fd = -1;
+}
+
+static void add(unsigned address, const void *data, size_t len)
+{
+  struct answer *a;
+  int i;
+
+  for (i = 0; i < answers; i++) {
+    if (answer[i].address == address)
+      return;
+  }
+  if (answers == MAX_ANSWERS)
+    return;
+  a = &answer[answers++];
+  a->address = address;
+  a->ms = now_ms() - started;
+  a->len = len < sizeof a->data ? len : sizeof a->data;
+  memcpy(a->data, data, a->len);
+}
+
+/* Take complete replies out of the buffer. */
+static void parse(struct scan *s)
+{
+  char *p = s->buffer, *end;
+  size_t n, left = s->len;
+  unsigned address;
+  int len;
+
+  while ((end = memchr(p, '\n', left)) != NULL) {
+    n = end - p + 1;
+    if (strncmp(p, "ANS ", 4) == 0) {
+      if (sscanf(p + 4, "%o %d", &address, &len) != 2 || len < 0) {
+        fprintf(stderr, "Bad reply from NCP\n");
+        stop(s);
+        return;
+      }
+      if (left < n + len)
+        break;
+      add(address, end + 1, len);
+      n += len;
+    } else {
+      /* CLS or LOS: the NCP won't send any more. */
+      *end = 0;
+      if (end > p && end[-1] == '\r')
+        end[-1] = 0;
+      fprintf(stderr, "BRD to %s: %s\n", s->subnets, p);
+      stop(s);
+      return;
+    }
+    p += n;
+    left -= n;
+  }
+
+  memmove(s->buffer, p, left);
+  s->len = left;
+}
+
+static void receive(struct scan *s)
+{
+  ssize_t n;
+
+  n = read(s->fd, s->buffer + s->len, sizeof s->buffer - s->len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    stop(s);
+    return;
+  }
+  s->len += n;
+  parse(s);
+  if (s->fd >= 0 && s->len == sizeof s->buffer) {
+    fprintf(stderr, "Reply too long\n");
+    stop(s);
+  }
+}
+
+static int compare(const void *a, const void *b)
+{
+  const struct answer *x = a, *y = b;
+  return (int)x->address - (int)y->address;
+}
+
+/* The host name in a STATUS reply. */
+static void status_name(const struct answer *a, char *name)
+{
+  size_t n = a->len < STATUS_NAME ? a->len : STATUS_NAME;
+  memcpy(name, a->data, n);
+  name[n] = 0;
+  while (n > 0 && name[n - 1] == ' ')
+    name[--n] = 0;
+}
+
+/* The start of any other reply, made printable. */
+static void text(const struct answer *a, char *line, size_t size)
+{
+  size_t i;
+  for (i = 0; i < a->len && i < size - 1; i++) {
+    if (a->data[i] == 0215)
+      line[i] = ' ';
+    else if (a->data[i] < 040 || a->data[i] >= 0177)
+      line[i] = '.';
+    else
+      line[i] = a->data[i];
+  }
+  line[i] = 0;
+}
+
+static void print(int status, int cache)
+{
+  char line[61];
+  int i;
+
+  qsort(answer, answers, sizeof answer[0], compare);
+  printf("%-8s %-6s %6s  %s\n", "Address", "Subnet", "ms",
+         status ? "Name" : "Answer");
+  for (i = 0; i < answers; i++) {
+    if (status)
+      status_name(&answer[i], line);
+    else
+      text(&answer[i], line, sizeof line);
+    printf("%-8o %-6o %6lld  %s\n", answer[i].address,
+           answer[i].address >> 8, answer[i].ms, line);
+    if (status && cache && line[0] != 0 && strpbrk(line, " \t") == NULL)
+      chaos_host_cache_add(line, answer[i].address);
+  }
+  printf("%d host%s answered.\n", answers, answers == 1 ? "" : "s");
+}
+
+int main(int argc, char **argv)
+{
+  const char *contact = "STATUS";
+  char args[MAX_PACKET];
+  struct pollfd pfd[MAX_SCANS];
+  int timeout = 2000, cache = 0;
+  int c, i, n, left;
+  long long deadline;
+
+  while ((c = getopt(argc, argv, "cs:t:")) != -1) {
+    switch (c) {
+    case 'c':
+      cache = 1;
+      break;
+    case 's':
+      if (scans == MAX_SCANS) {
+        fprintf(stderr, "Too many -s options\n");
+        usage(argv[0]);
+      }
+      scan[scans++].subnets = optarg;
+      break;
+    case 't':
+      timeout = atoi(optarg);
+      if (timeout < 1) {
+        fprintf(stderr, "Bad timeout %s\n", optarg);
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind < argc)
+    contact = argv[optind++];
+  args[0] = 0;
+  for (; optind < argc; optind++) {
+    if (strlen(args) + strlen(argv[optind]) + 2 > sizeof args)
+      usage(argv[0]);
+    if (args[0])
+      strcat(args, " ");
+    strcat(args, argv[optind]);
+  }
+  if (scans == 0)
+    scan[scans++].subnets = "all";
+
+  started = now_ms();
+  deadline = started + timeout;
+  for (i = 0; i < scans; i++)
+    start(&scan[i], contact, args);
+
+  while ((left = deadline - now_ms()) > 0) {
+    for (i = n = 0; i < scans; i++) {
+      if (scan[i].fd < 0)
+        continue;
+      pfd[n].fd = scan[i].fd;
+      pfd[n++].events = POLLIN;
+    }
+    if (n == 0)
+      break;
+    if (poll(pfd, n, left) < 0 && errno != EINTR) {
+      fprintf(stderr, "Poll error: %s\n", strerror(errno));
+      exit(1);
+    }
+    for (i = n = 0; i < scans; i++) {
+      if (scan[i].fd < 0)
+        continue;
+      if (pfd[n++].revents)
+        receive(&scan[i]);
+    }
+  }
+
+  for (i = 0; i < scans; i++) {
+    if (scan[i].fd >= 0)
+      stop(&scan[i]);
+  }
+  print(strcasecmp(contact, "STATUS") == 0, cache);
+  return 0;
+}
@@ -0,0 +1,451 @@
+/* Chaosnet simulator.
+
+   This stands in for both the NCP and the hosts on the network, so
+   the tools can be tested and measured without either.  It listens
+   to the same sockets as the NCP in cbridge, and all packets go
+   through a simulated network with latency, limited bandwidth and
+   loss.  Every host address is served by the simulator itself: an
+   RFC goes to a listener on any address, or to a command started for
+   the contact.
+
+   With -u, it also takes CHUDP packets on a UDP port, so programs
+   using CHAOS_BRIDGE can join.  Packets for an address that has been
+   heard from over UDP are sent there, and broadcasts go to all of
+   them. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "chaos.h"
+#include "ncp.h"
+
+#define MAX_HANDLERS 32
+#define MAX_PEERS    64
+
+struct handler {
+  const char *contact;
+  const char *command;
+};
+
+struct flight {
+  struct flight *next;
+  long long arrival;
+  size_t len;
+  unsigned char packet[CHAOS_MAX_WIRE];
+};
+
+struct peer {
+  unsigned address;
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
+
+static struct ncp *ncp;
+static struct handler handler[MAX_HANDLERS];
+static int handlers;
+static struct peer peer[MAX_PEERS];
+static int peers;
+static struct flight *flights;
+static int latency;         /* Milliseconds one way. */
+static int jitter;          /* Milliseconds of random extra delay. */
+static long bandwidth;      /* Bytes per second, or 0 for no limit. */
+static double loss;         /* Fraction of packets dropped. */
+static long long link_free; /* When the simulated link is idle again. */
+static int udp = -1;
+static int verbose;
+static unsigned long sent, dropped;
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fatal(const char *message)
+{
+  fprintf(stderr, "Fatal error %s: %s\n", message, strerror(errno));
+  exit(1);
+}
+
+static void trace(const char *what, const unsigned char *packet, size_t len)
+{
+  const unsigned char *data;
+  unsigned dest, src;
+  int opcode;
+  size_t n;
+
+  if (!verbose || chaos_packet_decode(packet, len, &opcode,
+                                      &dest, &src, &data, &n) < 0)
+    return;
+  fprintf(stderr, "%s %o -> %o opcode %o, %zu bytes, pkn %u ack %u\n",
+          what, src, dest, opcode, n,
+          (packet[12] << 8) | packet[13], (packet[14] << 8) | packet[15]);
+}
+
+static struct peer *find_peer(unsigned address)
+{
+  int i;
+  for (i = 0; i < peers; i++) {
+    if (peer[i].address == address)
+      return &peer[i];
+  }
+  return NULL;
+}
+
+/* Put a packet on the simulated network. */
+static void transmit(void *arg, unsigned dest,
+                     const unsigned char *packet, size_t len)
+{
+  struct flight *f, **p;
+  long long now = now_ms(), start;
+
+  (void)arg;
+  (void)dest;
+  sent++;
+  if (loss > 0 && drand48() < loss) {
+    dropped++;
+    trace("Drop", packet, len);
+    return;
+  }
+
+  f = malloc(sizeof *f);
+  if (f == NULL)
+    return;
+  memcpy(f->packet, packet, len);
+  f->len = len;
+
+  /* Packets queue up behind each other on the link, then take the
+     latency to arrive. */
+  start = link_free > now ? link_free : now;
+  if (bandwidth > 0)
+    link_free = start + (long long)len * 1000 / bandwidth;
+  else
+    link_free = start;
+  f->arrival = link_free + latency;
+  if (jitter > 0)
+    f->arrival += lrand48() % (jitter + 1);
+
+  for (p = &flights; *p != NULL && (*p)->arrival <= f->arrival;
+       p = &(*p)->next)
+    ;
+  f->next = *p;
+  *p = f;
+}
+
+/* Deliver packets whose time has come. */
+static void arrive(void)
+{
+  long long now = now_ms();
+  const unsigned char *data;
+  struct flight *f;
+  unsigned char buffer[4 + CHAOS_MAX_WIRE];
+  unsigned dest, src;
+  struct peer *to;
+  int opcode, i;
+  size_t n;
+
+  while ((f = flights) != NULL && f->arrival <= now) {
+    flights = f->next;
+    trace("Packet", f->packet, f->len);
+    chaos_packet_decode(f->packet, f->len, &opcode, &dest, &src, &data, &n);
+    buffer[0] = 1;
+    buffer[1] = 1;
+    buffer[2] = buffer[3] = 0;
+    memcpy(buffer + 4, f->packet, f->len);
+    to = find_peer(dest);
+    if (dest == 0) {
+      /* Broadcast to everyone but the sender. */
+      for (i = 0; i < peers; i++) {
+        if (peer[i].address != src)
+          sendto(udp, buffer, f->len + 4, 0,
+                 (struct sockaddr *)&peer[i].addr, peer[i].len);
+      }
+      ncp_receive(ncp, f->packet, f->len);
+    } else if (to == NULL)
+      ncp_receive(ncp, f->packet, f->len);
+    else
+      sendto(udp, buffer, f->len + 4, 0,
+             (struct sockaddr *)&to->addr, to->len);
+    free(f);
+  }
+}
+
+static void receive_udp(void)
+{
+  unsigned char buffer[4 + CHAOS_MAX_WIRE + 16];
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof addr;
+  const unsigned char *data;
+  unsigned dest, src;
+  struct peer *from;
+  int opcode;
+  ssize_t m;
+  size_t n;
+
+  m = recvfrom(udp, buffer, sizeof buffer, 0,
+               (struct sockaddr *)&addr, &len);
+  if (m < 4 || buffer[0] != 1 || buffer[1] != 1)
+    return;
+  if (chaos_packet_decode(buffer + 4, m - 4, &opcode,
+                          &dest, &src, &data, &n) < 0)
+    return;
+
+  from = find_peer(src);
+  if (from == NULL && peers < MAX_PEERS) {
+    from = &peer[peers++];
+    from->address = src;
+    if (verbose)
+      fprintf(stderr, "Host %o is on UDP\n", src);
+  }
+  if (from != NULL) {
+    memcpy(&from->addr, &addr, len);
+    from->len = len;
+  }
+
+  transmit(NULL, dest, buffer + 4, m - 4);
+}
+
+/* Start the command for a contact, with the connection on its
+   standard input and output.  The simulator's sockets are all
+   close-on-exec, so the command holds no other connection open. */
+static int start_handler(void *arg, struct ncp *ncp, unsigned dest,
+                         unsigned src, const char *contact, const char *args)
+{
+  char host[10], remote[10];
+  int i, fd[2];
+
+  (void)arg;
+  for (i = 0; i < handlers; i++) {
+    if (strcasecmp(handler[i].contact, contact) == 0)
+      break;
+  }
+  if (i == handlers)
+    return 0;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd) < 0)
+    return 0;
+  switch (fork()) {
+  case -1:
+    close(fd[0]);
+    close(fd[1]);
+    return 0;
+  case 0:
+    dup2(fd[1], 0);
+    dup2(fd[1], 1);
+    close(fd[0]);
+    close(fd[1]);
+    snprintf(host, sizeof host, "%o", dest);
+    snprintf(remote, sizeof remote, "%o", src);
+    setenv("CHAOS_HOST", host, 1);
+    setenv("CHAOS_REMOTE", remote, 1);
+    setenv("CHAOS_CONTACT", contact, 1);
+    setenv("CHAOS_ARGS", args, 1);
+    execl("/bin/sh", "sh", "-c", handler[i].command, (char *)NULL);
+    _exit(127);
+  }
+
+  close(fd[1]);
+  if (verbose)
+    fprintf(stderr, "Contact %s on %o from %o: %s\n",
+            contact, dest, src, handler[i].command);
+  if (ncp_serve(ncp, fd[0], contact) < 0) {
+    close(fd[0]);
+    return 0;
+  }
+  return 1;
+}
+
+static int listen_socket(const char *directory, const char *name)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    fatal("creating socket");
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%s", directory, name);
+  unlink(addr.sun_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+    fatal(addr.sun_path);
+  if (listen(fd, SOMAXCONN) < 0)
+    fatal("listen");
+  return fd;
+}
+
+static int udp_socket(int port)
+{
+  struct sockaddr_in addr;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    fatal("creating UDP socket");
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+    fatal("binding UDP port");
+  return fd;
+}
+
+static volatile sig_atomic_t report;
+
+static void request_report(int sig)
+{
+  (void)sig;
+  report = 1;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-v] [-a address] [-s directory] [-u port]\n"
+          "       [-l latency] [-j jitter] [-b bandwidth] [-p loss]"
+          " [-w window]\n"
+          "       [-c contact=command ...]\n", name);
+  fprintf(stderr, "  -a N  Octal address of the local host, default 401.\n");
+  fprintf(stderr, "  -b N  Bandwidth in bytes per second.\n");
+  fprintf(stderr, "  -c    Run command for RFCs to contact.\n");
+  fprintf(stderr, "  -j N  Random extra delay up to N milliseconds.\n");
+  fprintf(stderr, "  -l N  One way latency in milliseconds.\n");
+  fprintf(stderr, "  -p N  Percentage of packets lost.\n");
+  fprintf(stderr, "  -s D  Directory for the NCP sockets, default /tmp.\n");
+  fprintf(stderr, "  -u N  Take CHUDP packets on UDP port N.\n");
+  fprintf(stderr, "  -v    Verbose operation - log every packet.\n");
+  fprintf(stderr, "  -w N  Default window size.\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  struct pollfd pfd[3 + NCP_MAX_CONN];
+  const char *directory = "/tmp";
+  unsigned address = 0401;
+  int stream, packet, window = 0;
+  int c, n, timeout;
+  long long wait;
+  char *p;
+
+  while ((c = getopt(argc, argv, "a:b:c:j:l:p:s:u:vw:")) != -1) {
+    switch (c) {
+    case 'a':
+      address = strtol(optarg, NULL, 8);
+      break;
+    case 'b':
+      bandwidth = atol(optarg);
+      break;
+    case 'c':
+      p = strchr(optarg, '=');
+      if (p == NULL || handlers == MAX_HANDLERS)
+        usage(argv[0]);
+      *p++ = 0;
+      handler[handlers].contact = optarg;
+      handler[handlers].command = p;
+      handlers++;
+      break;
+    case 'j':
+      jitter = atoi(optarg);
+      break;
+    case 'l':
+      latency = atoi(optarg);
+      break;
+    case 'p':
+      loss = atof(optarg) / 100;
+      break;
+    case 's':
+      directory = optarg;
+      break;
+    case 'u':
+      udp = udp_socket(atoi(optarg));
+      break;
+    case 'v':
+      verbose++;
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc)
+    usage(argv[0]);
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGUSR1, request_report);
+  srand48(time(NULL));
+
+  ncp = ncp_new(address, transmit, NULL);
+  if (ncp == NULL)
+    fatal("starting NCP");
+  ncp_any_address(ncp, start_handler);
+  if (window > 0)
+    ncp_window(ncp, window);
+
+  stream = listen_socket(directory, "chaos_stream");
+  packet = listen_socket(directory, "chaos_packet");
+
+  for (;;) {
+    pfd[0].fd = stream;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = packet;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = udp;
+    pfd[2].events = POLLIN;
+    n = ncp_pollfds(ncp, pfd + 3, NCP_MAX_CONN);
+
+    timeout = ncp_timeout(ncp);
+    if (flights != NULL) {
+      wait = flights->arrival - now_ms();
+      if (wait < 0)
+        wait = 0;
+      if (timeout < 0 || wait < timeout)
+        timeout = wait;
+    }
+
+    if (poll(pfd, n + 3, timeout) < 0) {
+      if (errno != EINTR)
+        fatal("poll");
+      pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+      n = 0;
+    }
+
+    if (report) {
+      fprintf(stderr, "%lu packets sent, %lu dropped, %d connections\n",
+              sent, dropped, ncp_connections(ncp));
+      report = 0;
+    }
+
+    if (pfd[0].revents & POLLIN) {
+      c = accept(stream, NULL, NULL);
+      if (c >= 0)
+        fcntl(c, F_SETFD, FD_CLOEXEC);
+      if (c >= 0 && ncp_client(ncp, c, 0) < 0)
+        close(c);
+    }
+    if (pfd[1].revents & POLLIN) {
+      c = accept(packet, NULL, NULL);
+      if (c >= 0)
+        fcntl(c, F_SETFD, FD_CLOEXEC);
+      if (c >= 0 && ncp_client(ncp, c, 1) < 0)
+        close(c);
+    }
+    if (pfd[2].revents & POLLIN)
+      receive_udp();
+    ncp_events(ncp, pfd + 3, n);
+    arrive();
+    ncp_timers(ncp);
+  }
+}
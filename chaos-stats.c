@@ -0,0 +1,317 @@
+/* Statistics.
+
+   With CHAOS_STATS set, the library counts packets and bytes by
+   opcode and direction, short reads and writes, and retries after
+   EAGAIN or EINTR, both for the process and for each buffered
+   connection.  It also keeps histograms of the time spent blocked
+   receiving packets, sending packets, and waiting for the answer to
+   an RFC.  The totals for the process also show how host names were
+   found by the host name cache.
+
+   The histograms have eight linear buckets for each power of two
+   microseconds, so they have about 12% resolution from a
+   microsecond up to an hour, in a fixed small array.
+
+   CHAOS_STATS is a file to append the statistics to, or - for
+   standard error.  They're written at exit and on SIGUSR2, and a
+   program can write them to its log with chaos_stats_dump.  When
+   CHAOS_STATS isn't set, each place that counts something only
+   checks a flag. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "chaos.h"
+
+#define SUB_BUCKETS 8
+#define BUCKETS (SUB_BUCKETS * 30)
+
+struct histogram {
+  unsigned long count;
+  unsigned long long sum, max;
+  unsigned long bucket[BUCKETS];
+};
+
+static const char *class_name[CHAOS_STAT_CLASSES] = {
+  "0", "RFC", "OPN", "CLS", "FWD", "ANS", "SNS", "STS",
+  "RUT", "LOS", "LSN", "MNT", "EOF", "UNC", "BRD",
+  "ACK", "DAT", "DWD", "other"
+};
+
+static const char *time_name[CHAOS_TIMES] = {
+  "Receive", "Send", "RFC"
+};
+
+int chaos_stats_on = -1;
+static int stats_fd = -1;
+static struct chaos_counters total;
+static struct histogram histogram[CHAOS_TIMES];
+static struct sigaction previous;
+
+static void dump_signal(int sig)
+{
+  int saved = errno;
+  chaos_stats_dump(stats_fd, NULL);
+  /* Packet capture may want the signal too. */
+  if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+    previous.sa_handler(sig);
+  errno = saved;
+}
+
+static void dump_exit(void)
+{
+  chaos_stats_dump(stats_fd, NULL);
+}
+
+static int stats_init(void)
+{
+  struct sigaction sa;
+  const char *name = getenv("CHAOS_STATS");
+
+  if (name == NULL || *name == 0)
+    return chaos_stats_on = 0;
+  if (strcmp(name, "-") == 0)
+    stats_fd = 2;
+  else
+    stats_fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (stats_fd < 0)
+    return chaos_stats_on = 0;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = dump_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, &previous);
+  atexit(dump_exit);
+  return chaos_stats_on = 1;
+}
+
+long long chaos_stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int opcode_class(int opcode)
+{
+  if (opcode < CHOP_BRD + 1)
+    return opcode;
+  if (opcode == CHOP_ACK)
+    return 15;
+  if (opcode >= CHOP_DWD)
+    return 17;
+  if (opcode >= CHOP_DAT)
+    return 16;
+  return 18;
+}
+
+void chaos_stats_packet(struct chaos_counters *conn, int direction,
+                        int opcode, size_t len)
+{
+  int c;
+
+  if (chaos_stats_on < 0 && !stats_init())
+    return;
+  c = opcode_class(opcode);
+  total.packets[direction][c]++;
+  total.bytes[direction][c] += len;
+  if (conn != NULL) {
+    conn->packets[direction][c]++;
+    conn->bytes[direction][c] += len;
+  }
+}
+
+void chaos_stats_event(struct chaos_counters *conn, int what)
+{
+  struct chaos_counters *c[2];
+  int i;
+
+  if (chaos_stats_on < 0 && !stats_init())
+    return;
+  c[0] = &total;
+  c[1] = conn;
+  for (i = 0; i < 2 && c[i] != NULL; i++) {
+    switch (what) {
+    case CHAOS_SHORT_READ:  c[i]->short_reads++; break;
+    case CHAOS_SHORT_WRITE: c[i]->short_writes++; break;
+    case CHAOS_RETRY:       c[i]->retries++; break;
+    }
+  }
+}
+
+static int bucket(unsigned long long us)
+{
+  int msb = 63 - __builtin_clzll(us | 1);
+  int i;
+  if (us < SUB_BUCKETS)
+    return us;
+  i = SUB_BUCKETS * (msb - 2) + ((us >> (msb - 3)) & (SUB_BUCKETS - 1));
+  return i < BUCKETS ? i : BUCKETS - 1;
+}
+
+/* Smallest value in a bucket. */
+static unsigned long long bucket_value(int i)
+{
+  int msb;
+  if (i < SUB_BUCKETS)
+    return i;
+  msb = i / SUB_BUCKETS + 2;
+  return (1ULL << msb) | ((unsigned long long)(i % SUB_BUCKETS) << (msb - 3));
+}
+
+void chaos_stats_time(int which, long long start)
+{
+  struct histogram *h = &histogram[which];
+  unsigned long long us;
+
+  if (chaos_stats_on < 0 && !stats_init())
+    return;
+  us = chaos_stats_now() - start;
+  h->count++;
+  h->sum += us;
+  if (us > h->max)
+    h->max = us;
+  h->bucket[bucket(us)]++;
+}
+
+static unsigned long long percentile(const struct histogram *h, int permille)
+{
+  unsigned long long want = (h->count * permille + 999) / 1000, n = 0;
+  int i;
+  for (i = 0; i < BUCKETS; i++) {
+    n += h->bucket[i];
+    if (n >= want)
+      return bucket_value(i);
+  }
+  return h->max;
+}
+
+/* The dump runs in a signal handler, so lines are made up without
+   stdio. */
+static char *put(char *p, const char *s)
+{
+  while (*s)
+    *p++ = *s++;
+  return p;
+}
+
+static char *put_number(char *p, unsigned long long x)
+{
+  char digits[20];
+  int i = 0;
+  do
+    digits[i++] = '0' + x % 10;
+  while ((x /= 10) > 0);
+  while (i > 0)
+    *p++ = digits[--i];
+  return p;
+}
+
+/* Pad with spaces to width columns from start. */
+static char *pad(char *p, const char *start, int width)
+{
+  while (p < start + width)
+    *p++ = ' ';
+  return p;
+}
+
+static int put_line(int fd, const char *line, const char *end)
+{
+  return write(fd, line, end - line) == end - line;
+}
+
+/* Write the counters for a connection, or for the whole process if
+   conn is NULL. */
+void chaos_stats_dump(int fd, const struct chaos_conn *conn)
+{
+  const struct chaos_counters *c = conn ? &conn->counters : &total;
+  const struct histogram *h;
+  struct chaos_host_stats hosts;
+  char line[400], *p;
+  int i;
+
+  if (chaos_stats_on <= 0 || fd < 0)
+    return;
+
+  p = put(line, "Chaos statistics, pid ");
+  p = put_number(p, getpid());
+  if (conn != NULL) {
+    p = put(p, " fd ");
+    p = put_number(p, conn->fd);
+  }
+  p = put(p, ":\n");
+  if (!put_line(fd, line, p))
+    return;
+
+  for (i = 0; i < CHAOS_STAT_CLASSES; i++) {
+    if (c->packets[0][i] == 0 && c->packets[1][i] == 0)
+      continue;
+    p = put(line, "  ");
+    p = put(p, class_name[i]);
+    p = pad(p, line, 8);
+    p = put(p, "sent ");
+    p = put_number(p, c->packets[CHAOS_SENT][i]);
+    p = put(p, " packets ");
+    p = put_number(p, c->bytes[CHAOS_SENT][i]);
+    p = put(p, " bytes, received ");
+    p = put_number(p, c->packets[CHAOS_RECEIVED][i]);
+    p = put(p, " packets ");
+    p = put_number(p, c->bytes[CHAOS_RECEIVED][i]);
+    p = put(p, " bytes\n");
+    if (!put_line(fd, line, p))
+      return;
+  }
+  p = put(line, "  ");
+  p = put_number(p, c->short_reads);
+  p = put(p, " short reads, ");
+  p = put_number(p, c->short_writes);
+  p = put(p, " short writes, ");
+  p = put_number(p, c->retries);
+  p = put(p, " retries\n");
+  if (!put_line(fd, line, p) || conn != NULL)
+    return;
+
+  for (i = 0; i < CHAOS_TIMES; i++) {
+    h = &histogram[i];
+    if (h->count == 0)
+      continue;
+    p = put(line, "  ");
+    p = put(p, time_name[i]);
+    p = pad(p, line, 10);
+    p = put_number(p, h->count);
+    p = put(p, " times, microseconds mean ");
+    p = put_number(p, h->sum / h->count);
+    p = put(p, ", 50% ");
+    p = put_number(p, percentile(h, 500));
+    p = put(p, ", 90% ");
+    p = put_number(p, percentile(h, 900));
+    p = put(p, ", 99% ");
+    p = put_number(p, percentile(h, 990));
+    p = put(p, ", 99.9% ");
+    p = put_number(p, percentile(h, 999));
+    p = put(p, ", max ");
+    p = put_number(p, h->max);
+    p = put(p, "\n");
+    if (!put_line(fd, line, p))
+      return;
+  }
+
+  chaos_host_cache_stats(&hosts);
+  if (hosts.hits + hosts.negative + hosts.misses == 0)
+    return;
+  p = put(line, "  Hosts   ");
+  p = put_number(p, hosts.hits);
+  p = put(p, " found, ");
+  p = put_number(p, hosts.negative);
+  p = put(p, " not existing, ");
+  p = put_number(p, hosts.misses);
+  p = put(p, " not cached, ");
+  p = put_number(p, hosts.queries);
+  p = put(p, " HOSTAB queries\n");
+  put_line(fd, line, p);
+}
@@ -16,29 +16,56 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include "chaos.h"
+#include "chaos-probe.h"
 
 static const char *chaos_socket_directory = "/tmp";
 
-static int connect_to_named_socket(int type, char *path)
+/* Milliseconds before connecting again to an NCP whose queue of
+   connections was full. */
+#define CONNECT_RETRY 10
+
+static int connect_named(int sock, const char *path)
 {
-  int sock, slen;
+  int slen;
   struct sockaddr_un server;
+  const char *directory = getenv("CHAOS_SOCKET_DIRECTORY");
+
+  server.sun_family = AF_UNIX;
+  if (directory == NULL)
+    directory = chaos_socket_directory;
+  snprintf(server.sun_path, sizeof server.sun_path, "%s/%s", directory, path);
+  slen = strlen(server.sun_path)+ 1 + sizeof(server.sun_family);
+  return connect(sock, (struct sockaddr *)&server, slen);
+}
+
+/* A non-blocking Unix socket gets EAGAIN rather than EINPROGRESS if
+   the NCP's queue is full, and is left unconnected for the caller to
+   try again. */
+static int connect_to_named_socket(int type, char *path)
+{
+  int sock;
+
+  if (getenv("CHAOS_BRIDGE") != NULL)
+    return chudp_connect(type, path);
   
   if ((sock = socket(AF_UNIX, type, 0)) < 0)
     return -1;
   
-  server.sun_family = AF_UNIX;
-  sprintf(server.sun_path, "%s/%s", chaos_socket_directory, path);
-  slen = strlen(server.sun_path)+ 1 + sizeof(server.sun_family);
-
-  if (connect(sock, (struct sockaddr *)&server, slen) < 0)
+  if (connect_named(sock, path) < 0 && errno != EINPROGRESS
+      && !(errno == EAGAIN && (type & SOCK_NONBLOCK))) {
+    close(sock);
     return -1;
+  }
 
   return sock;
 }
@@ -48,34 +75,270 @@ int chaos_stream(void)
   return connect_to_named_socket(SOCK_STREAM, "chaos_stream");
 }
 
-int chaos_stream_rfc_data(int fd, const char *host, const char *contact,
-                          void *data, size_t len)
+/* Requests for connection.  chaos_rfc_start connects to the stream
+   NCP and sends the RFC line without blocking; the caller then polls
+   rfc->fd for rfc->events, or not at all while they're 0, for at most
+   chaos_rfc_timeout, and calls chaos_rfc_poll until it reports the
+   outcome.  chaos_stream_rfc_data does the same on an already
+   connected blocking socket.  Since chaos_rfc_start mustn't wait, it
+   only translates host names found in the cache or the hosts file,
+   and leaves others for the NCP. */
+
+static long long now_ms(void)
 {
-  char buffer[500];
-  ssize_t n;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Record a packet for tracing, capture, and statistics, if they're
+   on. */
+static void packet_seenv(struct chaos_counters *counters, int fd,
+                         int direction, int opcode,
+                         const struct iovec *iov, int iovcnt, size_t len)
+{
+  if (direction == CHAOS_SENT)
+    CHAOS_PROBE3(packet__send, fd, opcode, len);
+  else
+    CHAOS_PROBE3(packet__recv, fd, opcode, len);
+  if (chaos_capturing)
+    chaos_capture(fd, direction, opcode, iov, iovcnt);
+  if (chaos_stats_on)
+    chaos_stats_packet(counters, direction, opcode, len);
+}
+
+static void packet_seen(struct chaos_counters *counters, int fd,
+                        int direction, int opcode,
+                        const void *data, size_t len)
+{
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  packet_seenv(counters, fd, direction, opcode, &iov, 1, len);
+}
+
+/* Assemble the whole RFC line, so it can be sent in one write.
+   With wait zero, the host name is only looked for in the cache. */
+static int rfc_line(struct chaos_rfc *rfc, const char *host,
+                    const char *contact, const void *data, size_t len,
+                    int wait)
+{
+  char address[20];
+  int n;
 
-  if (dprintf(fd, "RFC %s %s", host, contact) < 0)
+  rfc->events = POLLOUT;
+  rfc->reason[0] = 0;
+  rfc->reply_len = 0;
+
+  if (wait)
+    host = chaos_host_resolve(host, address, sizeof address);
+  else
+    host = chaos_host_cached(host, address, sizeof address);
+  n = snprintf(rfc->line, sizeof rfc->line, "RFC %s %s%s",
+               host, contact, len > 0 ? " " : "");
+  if (n < 0 || n + len + 2 > sizeof rfc->line) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (len > 0)
+    memcpy(rfc->line + n, data, len);
+  memcpy(rfc->line + n + len, "\r\n", 2);
+  rfc->line_len = n + len + 2;
+  rfc->line_pos = 0;
+  return 0;
+}
+
+int chaos_rfc_start(struct chaos_rfc *rfc, const char *host,
+                    const char *contact, const void *data, size_t len,
+                    int timeout)
+{
+  rfc->fd = -1;
+  rfc->deadline = timeout < 0 ? -1 : now_ms() + timeout;
+  rfc->retry = 0;
+  if (chaos_stats_on)
+    rfc->started = chaos_stats_now();
+  if (rfc_line(rfc, host, contact, data, len, 0) < 0)
     return -1;
 
-  if (len > 0) {
-    char space = ' ';
-    if (write(fd, &space, 1) != 1)
-      return -1;
-    if (write(fd, data, len) != (ssize_t)len)
+  rfc->fd = connect_to_named_socket(SOCK_STREAM | SOCK_NONBLOCK,
+                                    "chaos_stream");
+  if (rfc->fd < 0)
+    return -1;
+  return rfc->fd;
+}
+
+/* Milliseconds left until the deadline, or until chaos_rfc_poll
+   should try connecting again, suitable for poll(). */
+int chaos_rfc_timeout(const struct chaos_rfc *rfc)
+{
+  long long due = rfc->deadline, left;
+  if (rfc->retry != 0 && (due < 0 || rfc->retry < due))
+    due = rfc->retry;
+  if (due < 0)
+    return -1;
+  left = due - now_ms();
+  return left < 0 ? 0 : left;
+}
+
+/* Connect again a socket the NCP had no room for.  Returns 1 when
+   connected or on the way, 0 to try later, or -1 on error.  Until
+   then, rfc->events is 0, since an unconnected socket polls as hung
+   up. */
+static int rfc_connect(struct chaos_rfc *rfc)
+{
+  if (rfc->retry != 0 && now_ms() < rfc->retry)
+    return 0;
+  if (connect_named(rfc->fd, "chaos_stream") < 0 && errno != EINPROGRESS) {
+    if (errno != EAGAIN)
       return -1;
+    if (chaos_stats_on)
+      chaos_stats_event(NULL, CHAOS_RETRY);
+    rfc->retry = now_ms() + CONNECT_RETRY;
+    rfc->events = 0;
+    return 0;
   }
-  if (dprintf(fd, "\r\n") < 0)
-    return -1;
+  rfc->retry = 0;
+  rfc->events = POLLOUT;
+  return 1;
+}
 
-  n = read(fd, buffer, sizeof buffer);
+/* Read the reply line.  The socket is peeked first, and only bytes up
+   to and including the newline are consumed, so whatever the far end
+   sends right after OPN is left for the caller's first read. */
+static int rfc_reply(struct chaos_rfc *rfc)
+{
+  static const struct { const char *name; int opcode; } replies[] = {
+    { "OPN", CHOP_OPN }, { "CLS", CHOP_CLS },
+    { "LOS", CHOP_LOS }, { "ANS", CHOP_ANS }
+  };
+  char *p = rfc->reply + rfc->reply_len;
+  char *end, *reason;
+  ssize_t n;
+  size_t i;
+
+  n = recv(rfc->fd, p, sizeof rfc->reply - 1 - rfc->reply_len, MSG_PEEK);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    if (chaos_stats_on)
+      chaos_stats_event(NULL, CHAOS_RETRY);
+    return 0;
+  }
   if (n < 0)
-    return n;
+    return -1;
   if (n == 0) {
     errno = ECONNABORTED;
     return -1;
   }
 
-  if (strncmp(buffer, "OPN ", 4) != 0) {
+  end = memchr(p, '\n', n);
+  if (end != NULL)
+    n = end - p + 1;
+  if (read(rfc->fd, p, n) != n)
+    return -1;
+  rfc->reply_len += n;
+  if (end == NULL) {
+    if (rfc->reply_len == sizeof rfc->reply - 1) {
+      errno = EPROTO;
+      return -1;
+    }
+    return 0;
+  }
+
+  *end = 0;
+  if (end > rfc->reply && end[-1] == '\r')
+    end[-1] = 0;
+  /* An opcode, then nothing or a space and the text. */
+  if (strlen(rfc->reply) < 3
+      || (rfc->reply[3] != 0 && rfc->reply[3] != ' ')) {
+    errno = EPROTO;
+    return -1;
+  }
+  reason = rfc->reply + 3;
+  while (*reason == ' ')
+    reason++;
+  strcpy(rfc->reason, reason);
+
+  for (i = 0; i < sizeof replies / sizeof replies[0]; i++) {
+    if (strncmp(rfc->reply, replies[i].name, 3) == 0) {
+      packet_seen(NULL, rfc->fd, CHAOS_RECEIVED, replies[i].opcode,
+                  rfc->reason, strlen(rfc->reason));
+      if (chaos_stats_on)
+        chaos_stats_time(CHAOS_TIME_RFC, rfc->started);
+      return replies[i].opcode;
+    }
+  }
+  errno = ECONNABORTED;
+  return -1;
+}
+
+/* Make progress on the handshake.  Returns 0 while it's still in
+   progress, the opcode of the reply (CHOP_OPN, CHOP_CLS, CHOP_LOS, or
+   CHOP_ANS) when done, or -1 on error.  The reply text, e.g. the
+   reason for a CLS, is left in rfc->reason. */
+int chaos_rfc_poll(struct chaos_rfc *rfc)
+{
+  ssize_t n;
+
+  if (rfc->deadline >= 0 && now_ms() >= rfc->deadline) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (rfc->retry != 0 && (n = rfc_connect(rfc)) <= 0)
+    return n;
+
+  while (rfc->line_pos < rfc->line_len) {
+    n = write(rfc->fd, rfc->line + rfc->line_pos,
+              rfc->line_len - rfc->line_pos);
+    if (n < 0 && errno == ENOTCONN && rfc->line_pos == 0) {
+      if ((n = rfc_connect(rfc)) <= 0)
+        return n;
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (chaos_stats_on)
+        chaos_stats_event(NULL, CHAOS_RETRY);
+      return 0;
+    }
+    if (n < 0)
+      return -1;
+    rfc->line_pos += n;
+  }
+
+  if (rfc->events == POLLOUT)
+    packet_seen(NULL, rfc->fd, CHAOS_SENT, CHOP_RFC, rfc->line + 4,
+                rfc->line_len - 6);
+  rfc->events = POLLIN;
+  return rfc_reply(rfc);
+}
+
+void chaos_rfc_abort(struct chaos_rfc *rfc)
+{
+  if (rfc->fd >= 0)
+    close(rfc->fd);
+  rfc->fd = -1;
+}
+
+int chaos_stream_rfc_data(int fd, const char *host, const char *contact,
+                          void *data, size_t len)
+{
+  struct chaos_rfc rfc;
+  int x;
+
+  if (rfc_line(&rfc, host, contact, data, len, 1) < 0)
+    return -1;
+  rfc.fd = fd;
+  if (chaos_stats_on)
+    rfc.started = chaos_stats_now();
+
+  if (write(fd, rfc.line, rfc.line_len) != (ssize_t)rfc.line_len)
+    return -1;
+  packet_seen(NULL, fd, CHAOS_SENT, CHOP_RFC, rfc.line + 4, rfc.line_len - 6);
+
+  do
+    x = rfc_reply(&rfc);
+  while (x == 0);
+  if (x < 0)
+    return -1;
+  if (x != CHOP_OPN) {
     errno = ECONNABORTED;
     return -1;
   }
@@ -88,6 +351,128 @@ int chaos_stream_rfc(int fd, const char *host, const char *contact)
   return chaos_stream_rfc_data(fd, host, contact, NULL, 0);
 }
 
+/* Split a comma-separated list of hosts in place.  Returns the
+   number of hosts; the array is terminated by a null pointer.  If
+   there are more than max - 1, returns -1 with errno E2BIG. */
+int chaos_host_list(char *list, const char **hosts, int max)
+{
+  char *p;
+  int n = 0;
+
+  for (p = strtok(list, ","); p != NULL; p = strtok(NULL, ",")) {
+    if (n == max - 1) {
+      hosts[n] = NULL;
+      errno = E2BIG;
+      return -1;
+    }
+    hosts[n++] = p;
+  }
+  hosts[n] = NULL;
+  return n;
+}
+
+/* Race requests for connection to several hosts offering the same
+   service.  A new request is started every stagger milliseconds, or
+   right away when an earlier one fails; with stagger zero, all start
+   at once.  The first host to answer OPN wins, and the others are
+   closed.  Returns a blocking stream socket, and the index of the
+   winning host in *winner. */
+int chaos_stream_rfc_any(const char *const *hosts, const char *contact,
+                         const void *data, size_t len,
+                         int timeout, int stagger, int *winner)
+{
+  struct chaos_rfc rfc[CHAOS_MAX_HOSTS];
+  struct pollfd pfd[CHAOS_MAX_HOSTS];
+  char address[CHAOS_MAX_HOSTS][20];
+  const char *host[CHAOS_MAX_HOSTS];
+  long long deadline, next, now;
+  int i, n, started, active, x, t;
+  int fd = -1, error = ECONNABORTED;
+
+  for (n = 0; hosts[n] != NULL; n++)
+    ;
+  if (n == 0 || n > CHAOS_MAX_HOSTS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* This call blocks anyway, so the names can be looked up in full
+     before starting. */
+  for (i = 0; i < n; i++)
+    host[i] = chaos_host_resolve(hosts[i], address[i], sizeof address[i]);
+
+  deadline = timeout < 0 ? -1 : now_ms() + timeout;
+  next = now_ms();
+  started = active = 0;
+
+  while (started < n || active > 0) {
+    now = now_ms();
+    if (deadline >= 0 && now >= deadline) {
+      error = ETIMEDOUT;
+      break;
+    }
+    if (started < n && (active == 0 || now >= next)) {
+      i = started++;
+      if (chaos_rfc_start(&rfc[i], host[i], contact, data, len, -1) < 0) {
+        error = errno;
+        chaos_rfc_abort(&rfc[i]);
+      } else {
+        rfc[i].deadline = deadline;
+        active++;
+      }
+      next = now + stagger;
+      continue;
+    }
+
+    /* Wait for a reply, the next start, or the deadline.  Only with
+       neither of those is there no limit. */
+    t = deadline < 0 ? -1 : deadline > now ? (int)(deadline - now) : 0;
+    if (started < n && (t < 0 || next - now < t))
+      t = next > now ? (int)(next - now) : 0;
+    for (i = 0; i < started; i++) {
+      pfd[i].fd = rfc[i].events != 0 ? rfc[i].fd : -1;
+      pfd[i].events = rfc[i].events;
+      x = rfc[i].fd >= 0 ? chaos_rfc_timeout(&rfc[i]) : -1;
+      if (x >= 0 && (t < 0 || x < t))
+        t = x;
+    }
+    if (poll(pfd, started, t) < 0 && errno != EINTR)
+      break;
+
+    for (i = 0; i < started; i++) {
+      if (rfc[i].fd < 0)
+        continue;
+      x = chaos_rfc_poll(&rfc[i]);
+      if (x == 0)
+        continue;
+      if (x == CHOP_OPN && fd < 0) {
+        fd = rfc[i].fd;
+        rfc[i].fd = -1;
+        if (winner != NULL)
+          *winner = i;
+        continue;
+      }
+      error = x < 0 ? errno : ECONNREFUSED;
+      chaos_rfc_abort(&rfc[i]);
+      active--;
+      next = now_ms();
+    }
+
+    if (fd >= 0)
+      break;
+  }
+
+  for (i = 0; i < started; i++)
+    chaos_rfc_abort(&rfc[i]);
+
+  if (fd < 0) {
+    errno = error;
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  return fd;
+}
+
 int chaos_packets(void)
 {
   return connect_to_named_socket(SOCK_STREAM, "chaos_packet");
@@ -95,6 +480,7 @@ int chaos_packets(void)
 
 ssize_t chaos_packet_recv(int fd, int *opcode, void *buffer)
 {
+  long long start = chaos_stats_on ? chaos_stats_now() : 0;
   unsigned char *data;
   ssize_t n, length;
   int len;
@@ -104,6 +490,8 @@ ssize_t chaos_packet_recv(int fd, int *opcode, void *buffer)
     n = recv(fd, data, len, 0);
     if (n <= 0)
       return n;
+    if (n < len && chaos_stats_on)
+      chaos_stats_event(NULL, CHAOS_SHORT_READ);
     data += n;
   }
 
@@ -117,41 +505,661 @@ ssize_t chaos_packet_recv(int fd, int *opcode, void *buffer)
       return len;
     if (n < 0)
       return n;
+    if (n < length - len && chaos_stats_on)
+      chaos_stats_event(NULL, CHAOS_SHORT_READ);
     data += n;
   }
 
+  packet_seen(NULL, fd, CHAOS_RECEIVED, *opcode, buffer, len);
+  if (chaos_stats_on)
+    chaos_stats_time(CHAOS_TIME_RECV, start);
   return len;
 }
 
-ssize_t chaos_packet_send(int fd, int opcode, const void *data, size_t len)
+/* Write out all of an iovec array, restarting after short writes. */
+static ssize_t write_all(int fd, struct iovec *iov, int iovcnt)
 {
-  const unsigned char *p;
-  unsigned char buf[4];
-  ssize_t n;
-  size_t m;
+  ssize_t n, total = 0;
+
+  while (iovcnt > 0) {
+    n = writev(fd, iov, iovcnt);
+    if (n < 0 && errno == EINTR) {
+      if (chaos_stats_on)
+        chaos_stats_event(NULL, CHAOS_RETRY);
+      continue;
+    }
+    if (n < 0)
+      return n;
+    if (n == 0)
+      break;
+    total += n;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+      if (chaos_stats_on)
+        chaos_stats_event(NULL, CHAOS_SHORT_WRITE);
+    }
+  }
 
+  return total;
+}
+
+static void packet_header(unsigned char *buf, int opcode, size_t len)
+{
   buf[0] = opcode;
   buf[1] = 0;
   buf[2] = len & 0xFF;
   buf[3] = (len >> 8) & 0xFF;
+}
+
+/* Send one packet with its data in several pieces.  The header and
+   data go out in a single writev(). */
+ssize_t chaos_packet_sendv(int fd, int opcode,
+                           const struct iovec *iov, int iovcnt)
+{
+  struct iovec v[CHAOS_MAX_IOV + 1];
+  unsigned char buf[4];
+  long long start = 0;
+  size_t len = 0;
+  ssize_t n;
+  int i;
+
+  if (iovcnt > CHAOS_MAX_IOV) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    v[i + 1] = iov[i];
+    len += iov[i].iov_len;
+  }
+  packet_header(buf, opcode, len);
+  v[0].iov_base = buf;
+  v[0].iov_len = sizeof buf;
+  CHAOS_PROBE3(packet__send, fd, opcode, len);
+  if (chaos_capturing)
+    chaos_capture(fd, CHAOS_SENT, opcode, iov, iovcnt);
+  if (chaos_stats_on) {
+    start = chaos_stats_now();
+    chaos_stats_packet(NULL, CHAOS_SENT, opcode, len);
+  }
+
+  n = write_all(fd, v, iovcnt + 1);
+  if (chaos_stats_on)
+    chaos_stats_time(CHAOS_TIME_SEND, start);
+  if (n < (ssize_t)sizeof buf)
+    return n < 0 ? n : 0;
+  return n - sizeof buf;
+}
+
+ssize_t chaos_packet_send(int fd, int opcode, const void *data, size_t len)
+{
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  return chaos_packet_sendv(fd, opcode, &iov, len > 0);
+}
+
+/* Buffered packet connection.  Instead of two or more recv() calls
+   per packet, read as much as the socket holds and parse out framed
+   packets from the buffer. */
+
+void chaos_conn_init(struct chaos_conn *conn, int fd)
+{
+  conn->fd = fd;
+  conn->in_start = conn->in_end = conn->in_scan = 0;
+  conn->in_offset = 0;
+  conn->cork = 0;
+  conn->out_len = 0;
+  conn->window = 0;
+  conn->sent = conn->acked = 0;
+  conn->ack_wait = 0;
+  memset(&conn->counters, 0, sizeof conn->counters);
+}
+
+size_t chaos_conn_buffered(const struct chaos_conn *conn)
+{
+  return conn->in_end - conn->in_start;
+}
+
+/* The receive buffer is full of packets the application hasn't
+   taken, so nothing more can be read until it does. */
+static int conn_full(const struct chaos_conn *conn)
+{
+  return chaos_conn_buffered(conn) == sizeof conn->in;
+}
+
+static ssize_t conn_fill(struct chaos_conn *conn, int flags)
+{
+  size_t m;
+  ssize_t n;
+
+  if (conn->in_start == conn->in_end)
+    conn->in_start = conn->in_end = conn->in_scan = 0;
+  else if (sizeof conn->in - conn->in_end < 4 + MAX_PACKET) {
+    memmove(conn->in, conn->in + conn->in_start, chaos_conn_buffered(conn));
+    conn->in_end -= conn->in_start;
+    conn->in_scan -= conn->in_start;
+    conn->in_start = 0;
+  }
+
+  m = sizeof conn->in - conn->in_end;
+  if (m == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  n = recv(conn->fd, conn->in + conn->in_end, m, flags);
+  if (n > 0)
+    conn->in_end += n;
+  return n;
+}
 
-  p = buf;
-  for (m = sizeof buf; m > 0; m -= n) {
-    n = send(fd, p, m, 0);
+static size_t packet_length(const unsigned char *p)
+{
+  return p[2] | ((size_t)p[3] << 8);
+}
+
+/* Window notifications from the NCP.  STS carries the receipt and
+   window size from the far end.  ACK comes in reply to an ACK sent to
+   the NCP, once all data packets sent so far are acknowledged; it may
+   also carry a count of acknowledged packets. */
+static void conn_notify(struct chaos_conn *conn, int opcode,
+                        const unsigned char *data, size_t len)
+{
+  if (opcode == CHOP_STS && len >= 4)
+    conn->window = data[2] | (data[3] << 8);
+  else if (opcode == CHOP_ACK) {
+    if (len >= 2)
+      conn->acked += data[0] | (data[1] << 8);
+    else
+      conn->acked = conn->sent;
+    if ((int)(conn->sent - conn->acked) < 0)
+      conn->acked = conn->sent;
+    conn->ack_wait = 0;
+  }
+}
+
+/* Take out the window notifications among the complete packets in
+   the receive buffer, leaving the others for chaos_conn_next. */
+static void conn_scan(struct chaos_conn *conn)
+{
+  unsigned char *p;
+  size_t length;
+
+  if (conn->in_scan < conn->in_start)
+    conn->in_scan = conn->in_start;
+
+  while (conn->in_end - conn->in_scan >= 4) {
+    p = conn->in + conn->in_scan;
+    length = packet_length(p);
+    if (length > MAX_PACKET || conn->in_end - conn->in_scan < 4 + length)
+      return;
+    if (p[0] == CHOP_ACK || p[0] == CHOP_STS) {
+      packet_seen(&conn->counters, conn->fd, CHAOS_RECEIVED,
+                  p[0], p + 4, length);
+      conn_notify(conn, p[0], p + 4, length);
+      memmove(p, p + 4 + length, conn->in_end - conn->in_scan - 4 - length);
+      conn->in_end -= 4 + length;
+    } else
+      conn->in_scan += 4 + length;
+  }
+}
+
+/* Return the next packet, with *data pointing into the receive
+   buffer.  The data stays valid until the next call on the
+   connection. */
+ssize_t chaos_conn_next(struct chaos_conn *conn, int *opcode,
+                        const unsigned char **data)
+{
+  unsigned char *p;
+  long long start;
+  size_t length;
+  ssize_t n;
+
+  for (;;) {
+    conn_scan(conn);
+    p = conn->in + conn->in_start;
+    if (chaos_conn_buffered(conn) >= 4) {
+      length = packet_length(p);
+      if (length > MAX_PACKET) {
+        errno = EMSGSIZE;
+        return -1;
+      }
+      if (chaos_conn_buffered(conn) >= 4 + length)
+        break;
+    }
+    start = chaos_stats_on ? chaos_stats_now() : 0;
+    n = conn_fill(conn, 0);
+    if (chaos_stats_on)
+      chaos_stats_time(CHAOS_TIME_RECV, start);
     if (n <= 0)
       return n;
-    p += n;
   }
 
-  p = data;
-  for (m = len; m > 0; m -= n) {
-    n = send(fd, p, m, 0);
-    if (n < 0)
-      return n;
-    if (n == 0)
-      return len - m;
-    p += n;
+  *opcode = p[0];
+  *data = p + 4 + conn->in_offset;
+  conn->in_start += 4 + length;
+  if (conn->in_offset == 0)
+    packet_seen(&conn->counters, conn->fd, CHAOS_RECEIVED,
+                *opcode, *data, length);
+  /* The rest of a packet chaos_conn_read stopped in. */
+  length -= conn->in_offset;
+  conn->in_offset = 0;
+  return length;
+}
+
+/* Set the window size until the NCP reports one. */
+void chaos_conn_window(struct chaos_conn *conn, int window)
+{
+  conn->window = window;
+}
+
+/* Number of data packets that can be sent without overrunning the
+   window.  Without a known window size, there's no limit. */
+int chaos_conn_available(const struct chaos_conn *conn)
+{
+  int outstanding = conn->sent - conn->acked;
+  if (conn->window <= 0)
+    return MAX_WINDOW;
+  return outstanding >= conn->window ? 0 : conn->window - outstanding;
+}
+
+/* Events to poll for: POLLOUT when the window is open, and POLLIN to
+   pick up notifications from the NCP unless the receive buffer is
+   full. */
+short chaos_conn_events(const struct chaos_conn *conn)
+{
+  return (chaos_conn_available(conn) > 0 ? POLLOUT : 0)
+    | (conn_full(conn) ? 0 : POLLIN);
+}
+
+/* Read whatever the NCP has sent without blocking, and update the
+   window from any notifications.  Other packets are kept for
+   chaos_conn_next.  With the receive buffer full, nothing is read. */
+int chaos_conn_process(struct chaos_conn *conn)
+{
+  ssize_t n;
+
+  if (conn_full(conn)) {
+    conn_scan(conn);
+    return chaos_conn_available(conn);
+  }
+  n = conn_fill(conn, MSG_DONTWAIT);
+  if (n == 0) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  if (n < 0 && errno != EAGAIN)
+    return -1;
+  conn_scan(conn);
+  return chaos_conn_available(conn);
+}
+
+/* Block until the window has room for another data packet, or for
+   at most timeout milliseconds unless timeout is negative.  Returns
+   the number of packets that can be sent, which is 0 if the time ran
+   out, or -1 on error.  While the receive buffer is full, the
+   notifications that would open the window can't be read, so the
+   wait is only for the time; with no time limit, it returns 0 at
+   once. */
+int chaos_conn_wait_window(struct chaos_conn *conn, int timeout)
+{
+  long long deadline = timeout < 0 ? -1 : now_ms() + timeout;
+  struct pollfd pfd;
+  int t = -1;
+
+  conn_scan(conn);
+  while (chaos_conn_available(conn) == 0) {
+    if (!conn->ack_wait) {
+      conn->ack_wait = 1;
+      if (chaos_conn_send(conn, CHOP_ACK, NULL, 0) < 0
+          || chaos_conn_flush(conn) < 0)
+        return -1;
+    }
+    if (deadline >= 0 && (t = deadline - now_ms()) <= 0)
+      break;
+    if (deadline < 0 && conn_full(conn))
+      break;
+    pfd.fd = conn->fd;
+    pfd.events = conn_full(conn) ? 0 : POLLIN;
+    if (poll(&pfd, 1, t) < 0 && errno != EINTR)
+      return -1;
+    if (chaos_conn_process(conn) < 0)
+      return -1;
+  }
+  return chaos_conn_available(conn);
+}
+
+ssize_t chaos_conn_recv(struct chaos_conn *conn, int *opcode, void *buffer)
+{
+  const unsigned char *data;
+  ssize_t n;
+
+  n = chaos_conn_next(conn, opcode, &data);
+  if (n > 0)
+    memcpy(buffer, data, n);
+  return n;
+}
+
+/* Queue a packet in the send buffer.  Unless the connection is
+   corked, the buffer is flushed right away. */
+ssize_t chaos_conn_send(struct chaos_conn *conn, int opcode,
+                        const void *data, size_t len)
+{
+  if (conn->out_len + 4 + len > sizeof conn->out) {
+    if (chaos_conn_flush(conn) < 0)
+      return -1;
+    if (4 + len > sizeof conn->out)
+      return chaos_packet_send(conn->fd, opcode, data, len);
   }
 
+  if (opcode >= CHOP_DAT || opcode == CHOP_EOF)
+    conn->sent++;
+  packet_seen(&conn->counters, conn->fd, CHAOS_SENT, opcode, data, len);
+  packet_header(conn->out + conn->out_len, opcode, len);
+  if (len > 0)
+    memcpy(conn->out + conn->out_len + 4, data, len);
+  conn->out_len += 4 + len;
+
+  if (!conn->cork && chaos_conn_flush(conn) < 0)
+    return -1;
   return len;
 }
+
+int chaos_conn_flush(struct chaos_conn *conn)
+{
+  struct iovec iov;
+  long long start;
+  ssize_t n;
+
+  if (conn->out_len == 0)
+    return 0;
+
+  iov.iov_base = conn->out;
+  iov.iov_len = conn->out_len;
+  start = chaos_stats_on ? chaos_stats_now() : 0;
+  n = write_all(conn->fd, &iov, 1);
+  if (chaos_stats_on)
+    chaos_stats_time(CHAOS_TIME_SEND, start);
+  if (n >= 0 && (size_t)n < conn->out_len)
+    errno = EPIPE;
+  n = (size_t)n == conn->out_len ? 0 : -1;
+  conn->out_len = 0;
+  return n;
+}
+
+/* While corked, packets accumulate in the send buffer until it fills
+   up or chaos_conn_flush is called.  Uncorking flushes. */
+int chaos_conn_cork(struct chaos_conn *conn, int cork)
+{
+  conn->cork = cork;
+  if (!cork)
+    return chaos_conn_flush(conn);
+  return 0;
+}
+
+/* Messages.  A message is any amount of data, sent as a stream of
+   data packets and read back regardless of where the packets were
+   split. */
+
+/* Pieces in one writev call from chaos_conn_send_message. */
+#define MESSAGE_IOV 256
+
+static int message_write(struct chaos_conn *conn, struct iovec *v, int nv,
+                         size_t bytes)
+{
+  long long start = chaos_stats_on ? chaos_stats_now() : 0;
+  ssize_t n = write_all(conn->fd, v, nv);
+  if (chaos_stats_on)
+    chaos_stats_time(CHAOS_TIME_SEND, start);
+  conn->out_len = 0;
+  if (n >= 0 && (size_t)n < bytes)
+    errno = EPIPE;
+  return (size_t)n == bytes ? 0 : -1;
+}
+
+/* Send the data in iov as packets of the given opcode, as few as
+   possible, each full except the last.  Packets point straight into
+   the caller's data, and go out in one writev call together with
+   anything in the send buffer, or one call per MESSAGE_IOV pieces for
+   a large message.  The window is not checked.  Returns the message
+   length, or -1 on error. */
+ssize_t chaos_conn_send_message(struct chaos_conn *conn, int opcode,
+                                const struct iovec *iov, int iovcnt)
+{
+  unsigned char header[MESSAGE_IOV][4];
+  struct iovec v[MESSAGE_IOV];
+  size_t total = 0, left, size, off = 0, bytes = 0, m, n;
+  int i, first, nv = 0;
+
+  if (iovcnt > CHAOS_MAX_IOV) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+
+  if (conn->out_len > 0) {
+    v[nv].iov_base = conn->out;
+    v[nv++].iov_len = bytes = conn->out_len;
+  }
+
+  i = 0;
+  left = total;
+  do {
+    /* A packet takes at most one piece from each iovec. */
+    if (nv + 1 + iovcnt - i > MESSAGE_IOV) {
+      if (message_write(conn, v, nv, bytes) < 0)
+        return -1;
+      nv = 0;
+      bytes = 0;
+    }
+
+    size = left < CHAOS_MAX_DATA ? left : CHAOS_MAX_DATA;
+    packet_header(header[nv], opcode, size);
+    v[nv].iov_base = header[nv];
+    v[nv++].iov_len = 4;
+    first = nv;
+    for (n = 0; n < size; n += m) {
+      while (off == iov[i].iov_len) {
+        i++;
+        off = 0;
+      }
+      m = iov[i].iov_len - off;
+      if (m > size - n)
+        m = size - n;
+      v[nv].iov_base = (char *)iov[i].iov_base + off;
+      v[nv++].iov_len = m;
+      off += m;
+    }
+
+    if (opcode >= CHOP_DAT || opcode == CHOP_EOF)
+      conn->sent++;
+    packet_seenv(&conn->counters, conn->fd, CHAOS_SENT, opcode,
+                 v + first, nv - first, size);
+    bytes += 4 + size;
+    left -= size;
+  } while (left > 0);
+
+  if (message_write(conn, v, nv, bytes) < 0)
+    return -1;
+  return total;
+}
+
+/* Read data from data packets straight into buffer, until it holds
+   len bytes, or up to and including a delimiter byte unless
+   delimiter is -1.  A message may begin and end anywhere in a packet;
+   the rest of the packet is left for the next call.  Returns the
+   number of bytes read.  This is short if a packet that isn't data
+   arrives first, which is left for chaos_conn_next, or if the
+   connection is closed.  Returns -1 on error. */
+ssize_t chaos_conn_read(struct chaos_conn *conn, void *buffer, size_t len,
+                        int delimiter)
+{
+  unsigned char *out = buffer, *p, *data, *end;
+  size_t have = 0, length, n;
+  long long start;
+  ssize_t m;
+
+  while (have < len) {
+    conn_scan(conn);
+    p = conn->in + conn->in_start;
+    if (chaos_conn_buffered(conn) < 4
+        || chaos_conn_buffered(conn) < 4 + packet_length(p)) {
+      if (chaos_conn_buffered(conn) >= 4 && packet_length(p) > MAX_PACKET) {
+        errno = EMSGSIZE;
+        return -1;
+      }
+      start = chaos_stats_on ? chaos_stats_now() : 0;
+      m = conn_fill(conn, 0);
+      if (chaos_stats_on)
+        chaos_stats_time(CHAOS_TIME_RECV, start);
+      if (m < 0)
+        return -1;
+      if (m == 0)
+        break;
+      continue;
+    }
+
+    if (p[0] < CHOP_DAT)
+      break;
+    length = packet_length(p);
+    if (conn->in_offset == 0)
+      packet_seen(&conn->counters, conn->fd, CHAOS_RECEIVED,
+                  p[0], p + 4, length);
+
+    data = p + 4 + conn->in_offset;
+    n = length - conn->in_offset;
+    if (n > len - have)
+      n = len - have;
+    end = NULL;
+    if (delimiter >= 0 && (end = memchr(data, delimiter, n)) != NULL)
+      n = end - data + 1;
+    memcpy(out + have, data, n);
+    have += n;
+
+    conn->in_offset += n;
+    if (conn->in_offset == length) {
+      conn->in_start += 4 + length;
+      conn->in_offset = 0;
+    }
+    if (end != NULL)
+      break;
+  }
+
+  return have;
+}
+
+/* Listener pool.  Keep several LSN connections outstanding for a
+   contact, so that a burst of RFCs isn't refused while a server is
+   busy starting up a new listener. */
+
+static int listen_one(struct chaos_listener *listener)
+{
+  char lsn[MAX_PACKET];
+  int fd, n;
+
+  fd = chaos_packets();
+  if (fd < 0)
+    return -1;
+  n = snprintf(lsn, sizeof lsn, "[winsize=%d] %s",
+               listener->winsize, listener->contact);
+  if (chaos_packet_send(fd, CHOP_LSN, lsn, n) != n) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Open listeners for any empty slots in the pool.  Returns the
+   number of listeners outstanding. */
+int chaos_listener_fill(struct chaos_listener *listener)
+{
+  int i, n = 0;
+  for (i = 0; i < listener->n; i++) {
+    if (listener->fd[i] < 0)
+      listener->fd[i] = listen_one(listener);
+    if (listener->fd[i] >= 0)
+      n++;
+  }
+  return n;
+}
+
+int chaos_listener_init(struct chaos_listener *listener, const char *contact,
+                        int winsize, int n)
+{
+  int i;
+
+  if (n < 1 || n > CHAOS_MAX_LISTEN) {
+    errno = EINVAL;
+    return -1;
+  }
+  listener->contact = contact;
+  listener->winsize = winsize;
+  listener->n = n;
+  for (i = 0; i < n; i++)
+    listener->fd[i] = -1;
+  return chaos_listener_fill(listener) > 0 ? 0 : -1;
+}
+
+/* Wait for an RFC to arrive on any of the listeners.  The connection
+   is taken out of the pool and set up in conn, with the RFC packet
+   waiting to be read; a new listener takes its place.  Returns the
+   socket, or -1 if no listeners could be opened.  If the NCP closed
+   a listener, it's replaced too, and -1 is returned with errno set
+   to ECONNRESET; the caller can try again. */
+int chaos_listener_accept(struct chaos_listener *listener,
+                          struct chaos_conn *conn)
+{
+  struct pollfd pfd[CHAOS_MAX_LISTEN];
+  int i, fd;
+  char c;
+
+  for (;;) {
+    if (chaos_listener_fill(listener) == 0)
+      return -1;
+    for (i = 0; i < listener->n; i++) {
+      pfd[i].fd = listener->fd[i];
+      pfd[i].events = POLLIN;
+      pfd[i].revents = 0;
+    }
+    if (poll(pfd, listener->n, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    for (i = 0; i < listener->n; i++) {
+      if (pfd[i].revents == 0)
+        continue;
+      fd = listener->fd[i];
+      listener->fd[i] = listen_one(listener);
+      /* A closed listener polls as readable too, so look for the
+         RFC before taking it as a connection. */
+      if ((pfd[i].revents & (POLLHUP | POLLERR)) != 0
+          && recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+        close(fd);
+        errno = ECONNRESET;
+        return -1;
+      }
+      chaos_conn_init(conn, fd);
+      return fd;
+    }
+  }
+}
+
+/* Close the listeners, e.g. in a child process that is going to
+   serve only its own connection. */
+void chaos_listener_close(struct chaos_listener *listener)
+{
+  int i;
+  for (i = 0; i < listener->n; i++) {
+    if (listener->fd[i] >= 0)
+      close(listener->fd[i]);
+    listener->fd[i] = -1;
+  }
+}
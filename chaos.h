@@ -2,6 +2,7 @@
 #define CHAOS_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 enum { CHOP_RFC=1, CHOP_OPN, CHOP_CLS, CHOP_FWD, CHOP_ANS, CHOP_SNS, CHOP_STS,
        CHOP_RUT, CHOP_LOS, CHOP_LSN, CHOP_MNT, CHOP_EOF, CHOP_UNC, CHOP_BRD };
@@ -12,12 +13,157 @@ enum { CHOP_RFC=1, CHOP_OPN, CHOP_CLS, CHOP_FWD, CHOP_ANS, CHOP_SNS, CHOP_STS,
 
 #define MAX_PACKET 492
 
+/* Most data in one packet. */
+#define CHAOS_MAX_DATA 488
+
+/* Size of the receive and send buffers in a packet connection.
+   Each holds several framed packets, so that one recv() call can
+   pick up a whole burst from the NCP, and one send() can push out
+   a burst to it. */
+#define CHAOS_BUFFER_SIZE 8192
+
+/* Max number of data pieces to chaos_packet_sendv. */
+#define CHAOS_MAX_IOV 15
+
+/* Largest window size. */
+#define MAX_WINDOW 128
+
+/* Packet and byte counts, by direction and opcode class.  Opcodes
+   below CHOP_BRD have a class each, and then there are ACK, DAT, DWD,
+   and everything else. */
+#define CHAOS_STAT_CLASSES 19
+enum { CHAOS_RECEIVED, CHAOS_SENT };
+
+struct chaos_counters {
+  unsigned long packets[2][CHAOS_STAT_CLASSES];
+  unsigned long bytes[2][CHAOS_STAT_CLASSES];
+  unsigned long short_reads, short_writes;
+  unsigned long retries;  /* EAGAIN or EINTR. */
+};
+
+struct chaos_conn {
+  int fd;
+  size_t in_start, in_end, in_scan;
+  size_t in_offset;       /* Data already read from the first packet. */
+  unsigned char in[CHAOS_BUFFER_SIZE];
+  int cork;
+  size_t out_len;
+  unsigned char out[CHAOS_BUFFER_SIZE];
+  int window;             /* Window size, or 0 if not known. */
+  unsigned sent, acked;   /* Data packets sent and acknowledged. */
+  int ack_wait;           /* ACK requested from the NCP. */
+  struct chaos_counters counters;
+};
+
 int chaos_stream(void);
 int chaos_stream_rfc(int fd, const char *host, const char *contact);
 int chaos_stream_rfc_data(int, const char *, const char *, void *, size_t);
 
+/* State of a non-blocking request for connection. */
+struct chaos_rfc {
+  int fd;
+  short events;
+  long long deadline;
+  long long retry;        /* When to connect again, or 0. */
+  long long started;      /* For statistics. */
+  size_t line_len, line_pos;
+  char line[MAX_PACKET + 8];
+  size_t reply_len;
+  char reply[MAX_PACKET];
+  char reason[MAX_PACKET];
+};
+
+int chaos_rfc_start(struct chaos_rfc *rfc, const char *host,
+                    const char *contact, const void *data, size_t len,
+                    int timeout);
+int chaos_rfc_poll(struct chaos_rfc *rfc);
+int chaos_rfc_timeout(const struct chaos_rfc *rfc);
+void chaos_rfc_abort(struct chaos_rfc *rfc);
+
+/* Max number of candidate hosts for chaos_stream_rfc_any. */
+#define CHAOS_MAX_HOSTS 16
+/* Default milliseconds between starting racing requests. */
+#define CHAOS_RFC_STAGGER 250
+
+int chaos_host_list(char *list, const char **hosts, int max);
+int chaos_stream_rfc_any(const char *const *hosts, const char *contact,
+                         const void *data, size_t len,
+                         int timeout, int stagger, int *winner);
+
+struct chaos_host_stats {
+  unsigned long hits;      /* Found in cache. */
+  unsigned long negative;  /* Found in cache as not existing. */
+  unsigned long misses;    /* Not in cache. */
+  unsigned long queries;   /* Sent to a HOSTAB server. */
+};
+
+const char *chaos_host_resolve(const char *host, char *buffer, size_t size);
+const char *chaos_host_cached(const char *host, char *buffer, size_t size);
+void chaos_host_cache_add(const char *name, int address);
+void chaos_host_cache_stats(struct chaos_host_stats *stats);
+
+/* Packet capture, when CHAOS_CAPTURE is set. */
+extern int chaos_capturing;
+void chaos_capture(int fd, int sent, int opcode,
+                   const struct iovec *iov, int iovcnt);
+void chaos_capture_data(int fd, int sent, int opcode,
+                        const void *data, size_t len);
+void chaos_capture_dump(void);
+
+/* Statistics, when CHAOS_STATS is set. */
+enum { CHAOS_SHORT_READ, CHAOS_SHORT_WRITE, CHAOS_RETRY };
+enum { CHAOS_TIME_RECV, CHAOS_TIME_SEND, CHAOS_TIME_RFC, CHAOS_TIMES };
+extern int chaos_stats_on;
+long long chaos_stats_now(void);
+void chaos_stats_packet(struct chaos_counters *conn, int direction,
+                        int opcode, size_t len);
+void chaos_stats_event(struct chaos_counters *conn, int what);
+void chaos_stats_time(int which, long long start);
+void chaos_stats_dump(int fd, const struct chaos_conn *conn);
+
+/* Chaos over UDP, when CHAOS_BRIDGE is set. */
+int chudp_connect(int type, const char *path);
+
 int chaos_packets(void);
 ssize_t chaos_packet_recv(int fd, int *opcode, void *buffer);
 ssize_t chaos_packet_send(int fd, int opcode, const void *data, size_t len);
+ssize_t chaos_packet_sendv(int fd, int opcode,
+                           const struct iovec *iov, int iovcnt);
+
+void chaos_conn_init(struct chaos_conn *conn, int fd);
+ssize_t chaos_conn_next(struct chaos_conn *conn, int *opcode,
+                        const unsigned char **data);
+ssize_t chaos_conn_recv(struct chaos_conn *conn, int *opcode, void *buffer);
+size_t chaos_conn_buffered(const struct chaos_conn *conn);
+ssize_t chaos_conn_send(struct chaos_conn *conn, int opcode,
+                        const void *data, size_t len);
+int chaos_conn_flush(struct chaos_conn *conn);
+int chaos_conn_cork(struct chaos_conn *conn, int cork);
+ssize_t chaos_conn_send_message(struct chaos_conn *conn, int opcode,
+                                const struct iovec *iov, int iovcnt);
+ssize_t chaos_conn_read(struct chaos_conn *conn, void *buffer, size_t len,
+                        int delimiter);
+void chaos_conn_window(struct chaos_conn *conn, int window);
+int chaos_conn_available(const struct chaos_conn *conn);
+short chaos_conn_events(const struct chaos_conn *conn);
+int chaos_conn_process(struct chaos_conn *conn);
+int chaos_conn_wait_window(struct chaos_conn *conn, int timeout);
+
+/* Max number of listeners in a pool. */
+#define CHAOS_MAX_LISTEN 32
+
+struct chaos_listener {
+  const char *contact;
+  int winsize;
+  int n;
+  int fd[CHAOS_MAX_LISTEN];
+};
+
+int chaos_listener_init(struct chaos_listener *listener, const char *contact,
+                        int winsize, int n);
+int chaos_listener_fill(struct chaos_listener *listener);
+int chaos_listener_accept(struct chaos_listener *listener,
+                          struct chaos_conn *conn);
+void chaos_listener_close(struct chaos_listener *listener);
 
 #endif /* CHAOS_H */
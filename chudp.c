@@ -0,0 +1,291 @@
+/* Chaosnet over UDP, without a separate NCP process.
+
+   When CHAOS_BRIDGE is set to host:port, the library doesn't connect
+   to the NCP sockets in the file system.  Instead each new socket is
+   one end of a socket pair, and the other end is served by an NCP
+   running in a thread of this process.  The NCP exchanges CHUDP
+   packets with the bridge, using the Chaos address in CHAOS_ADDRESS
+   and the UDP port in CHAOS_PORT, if set.
+
+   A forked child starts over with its own NCP and an unbound UDP
+   port the first time it opens a connection.  Connections made
+   before the fork keep being served by the parent. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "chaos.h"
+#include "ncp.h"
+
+#define CHUDP_VERSION 1
+#define CHUDP_PKT     1
+
+struct handover {
+  int fd;
+  int packet;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int started;
+static int forked;
+static int udp = -1;
+static int control[2] = { -1, -1 };
+static struct sockaddr_storage bridge;
+static socklen_t bridge_len;
+static struct ncp *ncp;
+
+static void transmit(void *arg, unsigned dest,
+                     const unsigned char *packet, size_t len)
+{
+  unsigned char buffer[4 + CHAOS_MAX_WIRE];
+  (void)arg;
+  (void)dest;
+  buffer[0] = CHUDP_VERSION;
+  buffer[1] = CHUDP_PKT;
+  buffer[2] = buffer[3] = 0;
+  memcpy(buffer + 4, packet, len);
+  sendto(udp, buffer, len + 4, 0, (struct sockaddr *)&bridge, bridge_len);
+}
+
+static void receive(void)
+{
+  unsigned char buffer[4 + CHAOS_MAX_WIRE + 16];
+  ssize_t n;
+
+  n = recv(udp, buffer, sizeof buffer, MSG_DONTWAIT);
+  if (n < 4 || buffer[0] != CHUDP_VERSION || buffer[1] != CHUDP_PKT)
+    return;
+  ncp_receive(ncp, buffer + 4, n - 4);
+}
+
+static void handover(void)
+{
+  struct handover h;
+  if (read(control[0], &h, sizeof h) != sizeof h || h.fd < 0)
+    return;
+  if (ncp_client(ncp, h.fd, h.packet) < 0)
+    close(h.fd);
+}
+
+static void *serve(void *arg)
+{
+  struct pollfd pfd[2 + NCP_MAX_CONN];
+  int n, timeout;
+
+  (void)arg;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    pfd[0].fd = udp;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = control[0];
+    pfd[1].events = POLLIN;
+    n = ncp_pollfds(ncp, pfd + 2, NCP_MAX_CONN);
+    timeout = ncp_timeout(ncp);
+    pthread_mutex_unlock(&lock);
+
+    if (poll(pfd, n + 2, timeout) < 0 && errno != EINTR)
+      pfd[0].revents = pfd[1].revents = 0;
+
+    pthread_mutex_lock(&lock);
+    if (pfd[0].revents & POLLIN)
+      receive();
+    if (pfd[1].revents & POLLIN)
+      handover();
+    ncp_events(ncp, pfd + 2, n);
+    ncp_timers(ncp);
+  }
+  return NULL;
+}
+
+static void wakeup(void)
+{
+  struct handover h = { -1, 0 };
+  ssize_t n;
+  if (started)
+    n = write(control[1], &h, sizeof h);
+  (void)n;
+}
+
+/* Keep the thread out of the NCP while forking.  It may be sleeping
+   in poll, so wake it up first. */
+static void prepare(void)
+{
+  wakeup();
+  pthread_mutex_lock(&lock);
+}
+
+static void parent(void)
+{
+  pthread_mutex_unlock(&lock);
+}
+
+/* The thread didn't follow into the child, so close everything the
+   parent's NCP owns. */
+static void child(void)
+{
+  if (started) {
+    ncp_free(ncp);
+    ncp = NULL;
+    close(udp);
+    close(control[0]);
+    close(control[1]);
+    udp = control[0] = control[1] = -1;
+    started = 0;
+  }
+  forked = 1;
+  pthread_mutex_unlock(&lock);
+}
+
+/* The thread dies with the process, so give it a few seconds to
+   deliver what the program wrote before exiting. */
+static void drain(void)
+{
+  int i;
+
+  pthread_mutex_lock(&lock);
+  if (started)
+    ncp_shutdown(ncp);
+  for (i = 0; started && i < 100 && ncp_connections(ncp) > 0; i++) {
+    wakeup();
+    pthread_mutex_unlock(&lock);
+    usleep(50000);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static int parse_bridge(const char *spec)
+{
+  struct addrinfo hints, *ai;
+  char host[256], *port;
+
+  snprintf(host, sizeof host, "%s", spec);
+  port = strrchr(host, ':');
+  if (port == NULL) {
+    fprintf(stderr, "CHAOS_BRIDGE should be host:port\n");
+    return -1;
+  }
+  *port++ = 0;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    fprintf(stderr, "Unknown bridge %s\n", spec);
+    return -1;
+  }
+  memcpy(&bridge, ai->ai_addr, ai->ai_addrlen);
+  bridge_len = ai->ai_addrlen;
+  freeaddrinfo(ai);
+
+  udp = socket(bridge.ss_family, SOCK_DGRAM, 0);
+  return udp;
+}
+
+static int bind_port(const char *port)
+{
+  struct sockaddr_storage local;
+  char *end;
+  long n = strtol(port, &end, 10);
+
+  if (*end != 0 || n <= 0 || n > 65535) {
+    fprintf(stderr, "Bad CHAOS_PORT %s\n", port);
+    return -1;
+  }
+  memset(&local, 0, sizeof local);
+  local.ss_family = bridge.ss_family;
+  if (local.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&local)->sin6_port = htons(n);
+  else
+    ((struct sockaddr_in *)&local)->sin_port = htons(n);
+  return bind(udp, (struct sockaddr *)&local, bridge_len);
+}
+
+static int start(void)
+{
+  static int registered;
+  const char *address, *port;
+  pthread_t thread;
+  char *end;
+  long n;
+
+  address = getenv("CHAOS_ADDRESS");
+  if (address == NULL) {
+    fprintf(stderr, "CHAOS_BRIDGE needs CHAOS_ADDRESS\n");
+    errno = EADDRNOTAVAIL;
+    return -1;
+  }
+  n = strtol(address, &end, 8);
+  if (*end != 0 || n <= 0 || n > 0177777) {
+    fprintf(stderr, "Bad CHAOS_ADDRESS %s\n", address);
+    errno = EADDRNOTAVAIL;
+    return -1;
+  }
+
+  if (parse_bridge(getenv("CHAOS_BRIDGE")) < 0)
+    goto fail;
+  port = getenv("CHAOS_PORT");
+  if (port != NULL && !forked && bind_port(port) < 0)
+    goto fail;
+  if (pipe(control) < 0)
+    goto fail;
+  ncp = ncp_new(n, transmit, NULL);
+  if (ncp == NULL)
+    goto fail;
+
+  if (!registered) {
+    pthread_atfork(prepare, parent, child);
+    atexit(drain);
+    registered = 1;
+  }
+  if (pthread_create(&thread, NULL, serve, NULL) != 0)
+    goto fail;
+  pthread_detach(thread);
+  started = 1;
+  return 0;
+
+ fail:
+  if (ncp != NULL)
+    ncp_free(ncp);
+  ncp = NULL;
+  if (udp >= 0)
+    close(udp);
+  if (control[0] >= 0) {
+    close(control[0]);
+    close(control[1]);
+  }
+  udp = control[0] = control[1] = -1;
+  return -1;
+}
+
+/* Return a new socket connected to the NCP in this process.  path
+   says which protocol, as for the NCP sockets in the file system. */
+int chudp_connect(int type, const char *path)
+{
+  struct handover h;
+  int sv[2];
+
+  pthread_mutex_lock(&lock);
+  if (!started && start() < 0) {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (socketpair(AF_UNIX, type, 0, sv) < 0)
+    return -1;
+  h.fd = sv[1];
+  h.packet = strcmp(path, "chaos_packet") == 0;
+  if (write(control[1], &h, sizeof h) != sizeof h) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  return sv[0];
+}
@@ -1,11 +1,12 @@
 #!/bin/sh
 
 GW=./gw
+CONF=./gateway.conf
 
-# Edit this script to set up any gateways you like.
+# Edit gateway.conf to set up any gateways you like.
 
 while test \! -e /tmp/chaos_stream; do
     sleep 1
 done
 
-"$GW" 95 SUPDUP 3150
+exec "$GW" -f "$CONF"
@@ -1,168 +1,2274 @@
+/* Gateway from TCP to Chaosnet.
+
+   One process serves every connection from a single epoll loop.
+   Each session has a buffer for each direction, sized for the
+   bandwidth-delay product: a pipe that data is spliced through
+   without passing through user space, or failing that, a ring in
+   memory.  A side is only read while its buffer has room, and only
+   written while there's something to write, so each direction flows
+   or stalls on its own.
+
+   The ports and the services they lead to come from the command
+   line, or from a configuration file that is read again on SIGHUP.
+   A reload keeps the listening sockets of ports that stay, and
+   sessions already open carry on with the mapping they came in by.
+
+   With -j, a parent process starts that many workers, each with its
+   own event loop and its own SO_REUSEPORT listeners, so the kernel
+   spreads connections over them.  The workers keep their counts in
+   memory shared with the parent, which adds them up on SIGUSR1,
+   passes SIGHUP on, and starts a worker again if one is killed.
+
+   A mapping's profile sets the TCP socket up for interactive use,
+   with Nagle's algorithm off, or for bulk transfers, corked and with
+   buffers the size of the gateway's.  The automatic profile starts
+   out interactive and switches by the size of what's being read.
+
+   A reverse mapping goes the other way: it keeps a few LSNs open on
+   a Chaos contact, and joins each RFC that comes in to a new TCP
+   connection to a server, or one made ahead of time from a pool.
+   OPN is only sent once the TCP connection is there.
+
+   Data to Chaosnet can be held back to fill packets: what doesn't
+   make a whole packet waits until more comes, the client goes quiet,
+   or a deadline passes.  That's only done for bulk transfers, since
+   a keystroke shouldn't wait.
+
+   New connections are accepted in batches, and turned away before
+   anything is sent to Chaosnet if there are too many sessions, or
+   too many new ones per second, overall or from one address.
+
+   The request for connection is made without blocking, racing
+   several hosts if more than one is given.  The first host asked can
+   instead be taken in turn or by fewest sessions.  A host whose RFC
+   fails is ejected, and can be checked with STATUS or an RFC in the
+   background, so that it's only asked first again once it answers.
+   When one side stops sending, the other side's output is shut down
+   once its buffer is drained, and the session ends when both
+   directions are done. */
+
+#define _GNU_SOURCE     /* For splice and accept4. */
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <poll.h>
 #include "chaos.h"
+#include "chaos-probe.h"
+
+#define MAX_EVENTS  64
+#define BUFFER_SIZE 65536   /* Default, the same as a pipe. */
+#define ACCEPT_BATCH 64     /* Connections taken per listener event. */
+#define SOURCE_HASH 1024
+#define BULK_READ   1024    /* Average read for the bulk profile, */
+#define SMALL_READ  128     /* and to go back to interactive. */
+#define REVERSE_LISTEN 4    /* Default LSNs for a reverse mapping. */
+#define MAX_POOL    64
+#define RETRY       1000    /* Milliseconds before opening again. */
+#define CHECK_TIMEOUT 2000  /* Milliseconds for a health check. */
+#define CONNECT_TIMEOUT 30  /* Seconds for a host to answer an RFC. */
+#define EJECT       10000   /* Milliseconds out, without checks. */
+
+enum { LISTENER, TCP, CHAOS, RFC, LSN, POOL, CHECK };
+enum { INTERACTIVE, BULK, AUTOMATIC };
+enum { RACE, TURNS, FEWEST };
+
+static const char *profile_name[] = { "interactive", "bulk", "auto" };
+static const char *balance_name[] = { "race", "rr", "least" };
+
+/* Something registered with epoll. */
+struct watch {
+  int what;
+  int fd;
+  unsigned events;      /* Registered, or 0 if not. */
+  int hup;              /* Both directions closed by the other end. */
+  struct mapping *mapping;
+  struct session *session;
+  int index;            /* Which RFC, LSN, pool socket, or host. */
+};
+
+/* What's known about one of a mapping's hosts. */
+struct backend {
+  const char *address;  /* Looked up when the mapping was read. */
+  char number[12];
+  struct watch watch;   /* A health check in progress. */
+  struct chaos_rfc probe;
+  int down;
+  long long down_until;
+  long long next_check;
+  int sessions;         /* Open or being requested. */
+};
+
+/* Waiting on a Chaos contact for an RFC. */
+struct lsn {
+  struct watch watch;
+  size_t len;
+  char line[MAX_PACKET + 8];
+};
+
+/* A connection to a reverse mapping's server, made ahead of time. */
+struct pooled {
+  struct watch watch;
+  int ready;
+};
+
+/* A TCP port leading to a Chaosnet service, or for a reverse
+   mapping, a Chaos contact leading to a TCP server.  A mapping that
+   is gone from the configuration is freed when its last session
+   is. */
+struct mapping {
+  struct mapping *next;
+  struct watch listener;
+  char *address;        /* To bind, or NULL for any; or the server. */
+  char *port;
+  char *contact;
+  char *list;           /* Where hosts point. */
+  const char *hosts[CHAOS_MAX_HOSTS + 1];
+  int nhosts;
+  struct backend backend[CHAOS_MAX_HOSTS];
+  int balance;
+  int turn;             /* Where the next session starts looking. */
+  int check;            /* Seconds between health checks, or 0. */
+  const char *probe;    /* Contact to check, or NULL for STATUS. */
+  int max;              /* Sessions allowed, or 0 for any number. */
+  int defer;            /* Seconds to wait for the client to send. */
+  int profile;
+  int coalesce;         /* Microseconds to hold data to Chaos. */
+  int timeout;          /* Seconds for a host to answer, or 0. */
+  int sessions;
+  int configured;
+  int reverse;
+  struct sockaddr_storage server;
+  socklen_t server_len;
+  struct lsn *lsn;
+  int listens;
+  struct pooled *pool;
+  int pooled;
+  long long retry;      /* When to open what failed, or 0. */
+  int failing;          /* Said so, until something works again. */
+};
+
+/* New connections allowed per second, with a burst of as many. */
+struct rate {
+  double tokens;
+  long long last;
+};
+
+/* Counts for one worker, in memory shared with the parent. */
+struct stats {
+  long sessions;
+  unsigned long connections, refused;
+  unsigned long long to_chaos, from_chaos;
+};
+
+/* An address that connections come from. */
+struct source {
+  struct source *next;
+  char address[INET6_ADDRSTRLEN];
+  int sessions;
+  struct rate rate;
+};
+
+/* Bytes in flight from one socket to the other.  start and end
+   count bytes taken out and put in; in memory, they're positions in
+   the ring modulo size. */
+struct buffer {
+  int pipe[2];
+  char *data;
+  size_t size;
+  size_t start, end;
+};
+
+struct racer {
+  struct chaos_rfc rfc;
+  struct watch watch;
+  int host;             /* Counted in its backend, or -1. */
+};
+
+struct session {
+  struct session *next, *prev;  /* Connecting, or once open, holding. */
+  struct mapping *mapping;
+  struct source *source;
+  char peer[INET6_ADDRSTRLEN];
+  struct watch tcp, chaos;
+  struct racer *racer;  /* Requests for connection, until one is open. */
+  int started, active;
+  unsigned tried;       /* Hosts asked, one bit each. */
+  int host;             /* The one that answered, or -1. */
+  long long next_start;
+  int tcp_eof, chaos_eof;
+  int tcp_shut, chaos_shut;
+  unsigned long long to_chaos, from_chaos;
+  unsigned long long pushed;  /* From Chaos when last uncorked. */
+  int bulk;
+  long average;         /* Bytes per read, for the automatic profile. */
+  int holding, flushing;
+  int dialing;          /* Reverse, connecting to the server. */
+  long long held, last; /* When data was first held, and last read. */
+  struct buffer in;     /* From TCP to Chaos. */
+  struct buffer out;    /* From Chaos to TCP. */
+};
+
+static const char *argv0;
+static const char *config;
+static struct mapping *mappings;
+static volatile sig_atomic_t reload, report, stopping, exited;
+static sigset_t waitmask;       /* Signals are only taken while waiting. */
+static size_t buffer_size = BUFFER_SIZE;
+static int backlog = SOMAXCONN;
+static int profile = INTERACTIVE;
+static int coalesce;
+static int defer;
+static int timeout = CONNECT_TIMEOUT;
+static int max_sessions, max_source_sessions;
+static double max_rate, max_source_rate;
+static int jobs = 1, pin;
+static struct stats *all_stats, *stats;
+static pid_t *workers;
+static struct rate rate;
+static struct source *sources[SOURCE_HASH];
+static int epoll;
+static struct session *connecting, *holding;
+static void **garbage;
+static int garbage_len, garbage_max;
+
+static void fatal(const char *message, int error)
+{
+  fprintf(stderr, "Fatal error %s\n", message);
+  if (error)
+    fprintf(stderr, ": %s", strerror(error));
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static long long now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long now_ms(void)
+{
+  return now_us() / 1000;
+}
+
+static int same(const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+  return strcmp(a, b) == 0;
+}
+
+/* Memory an event later in the same batch may still point to is
+   freed after the batch. */
+static void discard(void *p)
+{
+  void **g;
+  if (garbage_len == garbage_max) {
+    g = realloc(garbage, (garbage_max + 64) * sizeof *g);
+    if (g == NULL)
+      fatal("allocating memory", errno);
+    garbage = g;
+    garbage_max += 64;
+  }
+  garbage[garbage_len++] = p;
+}
+
+static void collect(void)
+{
+  while (garbage_len > 0)
+    free(garbage[--garbage_len]);
+}
+
+/* Change what epoll reports for a descriptor.  No events means not
+   registered at all. */
+static void watch(struct watch *w, unsigned events)
+{
+  struct epoll_event ev;
+  int op;
+
+  if (w->fd < 0 || w->events == events)
+    return;
+  ev.events = events;
+  ev.data.ptr = w;
+  if (w->events == 0 && events != 0)
+    op = EPOLL_CTL_ADD;
+  else if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+  if (epoll_ctl(epoll, op, w->fd, &ev) < 0 && op != EPOLL_CTL_DEL)
+    fprintf(stderr, "Error calling epoll_ctl: %s\n", strerror(errno));
+  w->events = events;
+}
+
+static void unwatch(struct watch *w)
+{
+  watch(w, 0);
+  if (w->fd >= 0)
+    close(w->fd);
+  w->fd = -1;
+}
+
+static void stop_reverse(struct mapping *m);
+static void stop_checks(struct mapping *m);
+
+static void free_mapping(struct mapping *m)
+{
+  unwatch(&m->listener);
+  stop_reverse(m);
+  stop_checks(m);
+  free(m->address);
+  free(m->port);
+  free(m->contact);
+  free(m->list);
+  discard(m);
+}
+
+/* Free a mapping once nothing uses it. */
+static void release(struct mapping *m)
+{
+  if (!m->configured && m->sessions == 0)
+    free_mapping(m);
+}
+
+static void count(void *counter, unsigned long long n)
+{
+  __atomic_fetch_add((unsigned long long *)counter, n, __ATOMIC_RELAXED);
+}
+
+static long total_sessions(void)
+{
+  long n = 0;
+  int i;
+  for (i = 0; i < jobs; i++)
+    n += __atomic_load_n(&all_stats[i].sessions, __ATOMIC_RELAXED);
+  return n;
+}
+
+/* Take a token for a new connection. */
+static int allow(struct rate *r, double per_second)
+{
+  long long now = now_ms();
+  double burst = per_second < 1 ? 1 : per_second;
+
+  if (per_second <= 0)
+    return 1;
+  if (r->last == 0)
+    r->tokens = burst;
+  else
+    r->tokens += (now - r->last) * per_second / 1000;
+  if (r->tokens > burst)
+    r->tokens = burst;
+  r->last = now;
+  if (r->tokens < 1)
+    return 0;
+  r->tokens -= 1;
+  return 1;
+}
+
+/* An address with no sessions and a full bucket can be forgotten. */
+static int idle(struct source *x)
+{
+  double elapsed = (now_ms() - x->rate.last) * max_source_rate / 1000;
+  return x->sessions == 0
+    && (max_source_rate <= 0 || x->rate.tokens + elapsed >= max_source_rate);
+}
+
+static struct source *find_source(const char *address)
+{
+  unsigned h = 0;
+  const char *p;
+  struct source **e, *x;
+
+  for (p = address; *p; p++)
+    h = h * 31 + (unsigned char)*p;
+  e = &sources[h % SOURCE_HASH];
+  while ((x = *e) != NULL) {
+    if (strcmp(x->address, address) == 0)
+      return x;
+    if (idle(x)) {
+      *e = x->next;
+      free(x);
+    } else
+      e = &x->next;
+  }
+
+  x = calloc(1, sizeof *x);
+  if (x == NULL)
+    return NULL;
+  strcpy(x->address, address);
+  x->next = *e;
+  *e = x;
+  return x;
+}
+
+static void link_session(struct session **list, struct session *s)
+{
+  s->prev = NULL;
+  s->next = *list;
+  if (*list != NULL)
+    (*list)->prev = s;
+  *list = s;
+}
+
+static void unlink_session(struct session **list, struct session *s)
+{
+  if (s->prev != NULL)
+    s->prev->next = s->next;
+  else if (*list == s)
+    *list = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+  s->next = s->prev = NULL;
+}
+
+static void stop_racing(struct session *s)
+{
+  int i;
+
+  if (s->racer == NULL)
+    return;
+  for (i = 0; i < s->started; i++) {
+    if (s->racer[i].host >= 0)
+      s->mapping->backend[s->racer[i].host].sessions--;
+    watch(&s->racer[i].watch, 0);
+    s->racer[i].watch.fd = -1;
+    chaos_rfc_abort(&s->racer[i].rfc);
+  }
+  discard(s->racer);
+  s->racer = NULL;
+  unlink_session(&connecting, s);
+}
+
+/* Switch a buffer to memory. */
+static int buffer_memory(struct buffer *b)
+{
+  if (b->pipe[0] >= 0) {
+    close(b->pipe[0]);
+    close(b->pipe[1]);
+    b->pipe[0] = b->pipe[1] = -1;
+  }
+  b->size = buffer_size;
+  if (b->data == NULL)
+    b->data = malloc(b->size);
+  return b->data == NULL ? -1 : 0;
+}
+
+/* Use a pipe if there are descriptors to spare.  The kernel rounds
+   its size up to a power of two pages, and may not allow more than
+   /proc/sys/fs/pipe-max-size. */
+static int buffer_init(struct buffer *b)
+{
+  int size;
+
+  b->data = NULL;
+  b->start = b->end = 0;
+  if (pipe2(b->pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+    size = fcntl(b->pipe[0], F_SETPIPE_SZ, (int)buffer_size);
+    if (size < 0)
+      size = fcntl(b->pipe[0], F_GETPIPE_SZ);
+    if (size > 0) {
+      b->size = size;
+      return 0;
+    }
+    close(b->pipe[0]);
+    close(b->pipe[1]);
+  }
+  b->pipe[0] = b->pipe[1] = -1;
+  return buffer_memory(b);
+}
+
+static void buffer_free(struct buffer *b)
+{
+  if (b->pipe[0] >= 0) {
+    close(b->pipe[0]);
+    close(b->pipe[1]);
+  }
+  free(b->data);
+  b->pipe[0] = b->pipe[1] = -1;
+  b->data = NULL;
+}
+
+static void disconnect(struct session *s, const char *message, int error)
+{
+  CHAOS_PROBE4(connection__close, s->tcp.fd, s->to_chaos, s->from_chaos,
+               message);
+  fprintf(stderr, "Host %s %s", s->peer, message);
+  if (error)
+    fprintf(stderr, ": %s", strerror(error));
+  fputc('\n', stderr);
+
+  stop_racing(s);
+  if (s->host >= 0)
+    s->mapping->backend[s->host].sessions--;
+  if (s->holding)
+    unlink_session(&holding, s);
+  unwatch(&s->tcp);
+  unwatch(&s->chaos);
+  buffer_free(&s->in);
+  buffer_free(&s->out);
+  s->mapping->sessions--;
+  release(s->mapping);
+  s->source->sessions--;
+  __atomic_fetch_sub(&stats->sessions, 1, __ATOMIC_RELAXED);
+  discard(s);
+}
+
+static size_t buffered(const struct buffer *b)
+{
+  return b->end - b->start;
+}
+
+static size_t room(const struct buffer *b)
+{
+  return b->size - buffered(b);
+}
+
+/* The part of the ring from position i for n bytes, in one or two
+   pieces.  Returns the number of pieces. */
+static int ring(const struct buffer *b, size_t i, size_t n,
+                struct iovec *iov)
+{
+  size_t offset = i % b->size;
+
+  iov[0].iov_base = b->data + offset;
+  if (offset + n <= b->size) {
+    iov[0].iov_len = n;
+    return 1;
+  }
+  iov[0].iov_len = b->size - offset;
+  iov[1].iov_base = b->data;
+  iov[1].iov_len = n - iov[0].iov_len;
+  return 2;
+}
+
+/* Read into the free part of a buffer.  Returns 0 at end of file. */
+static ssize_t fill(int fd, struct buffer *b)
+{
+  struct iovec iov[2];
+  ssize_t n;
+
+  if (b->start == b->end)
+    b->start = b->end = 0;
+  if (b->pipe[0] >= 0) {
+    n = splice(fd, NULL, b->pipe[1], NULL, room(b),
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    /* Not every kind of socket can be spliced.  The pipe is empty
+       when this is first tried. */
+    if (n < 0 && errno == EINVAL && b->end == 0 && buffer_memory(b) == 0)
+      return fill(fd, b);
+  } else
+    n = readv(fd, iov, ring(b, b->end, room(b), iov));
+  if (n > 0)
+    b->end += n;
+  return n;
+}
+
+/* Write up to size bytes from the buffer. */
+static ssize_t drain(int fd, struct buffer *b, size_t size)
+{
+  struct iovec iov[2];
+  ssize_t n;
+
+  if (size == 0)
+    return 0;
+  if (b->pipe[0] >= 0)
+    n = splice(b->pipe[0], NULL, fd, NULL, size,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  else
+    n = writev(fd, iov, ring(b, b->start, size, iov));
+  if (n > 0)
+    b->start += n;
+  else if (n < 0 && errno == EAGAIN)
+    n = 0;
+  return n;
+}
+
+/* Register what a side waits for.  A side with errors always
+   stays registered, except after a hangup, when only reading is
+   possible; then it's dropped while there's no room to read, so the
+   hangup isn't reported over and over. */
+static void interest(struct watch *w, unsigned events)
+{
+  if (w->hup)
+    events &= EPOLLIN;
+  else
+    events |= EPOLLERR;
+  watch(w, events);
+}
+
+/* Microseconds to hold back data to Chaos, or 0 to send it now. */
+static long long coalescing(struct session *s)
+{
+  int wait = s->mapping->coalesce >= 0 ? s->mapping->coalesce : coalesce;
+  return s->bulk ? wait : 0;
+}
+
+/* When held data must go: at the deadline, or once the client has
+   been quiet for a quarter of it. */
+static long long due(struct session *s)
+{
+  long long wait = coalescing(s);
+  long long deadline = s->held + wait, quiet = s->last + wait / 4;
+  return quiet < deadline ? quiet : deadline;
+}
+
+static void let_go(struct session *s)
+{
+  if (s->holding)
+    unlink_session(&holding, s);
+  s->holding = 0;
+}
+
+/* How much of the buffer to Chaos to send now.  While coalescing,
+   that's whole packets, and the rest waits for more. */
+static size_t ready(struct session *s)
+{
+  size_t n = buffered(&s->in), tail = n % CHAOS_MAX_DATA;
+
+  if (tail == 0 || s->tcp_eof || coalescing(s) == 0) {
+    let_go(s);
+    s->flushing = 0;
+    return n;
+  }
+  if (s->flushing)
+    return n;
+  if (!s->holding) {
+    s->held = now_us();
+    s->holding = 1;
+    link_session(&holding, s);
+  }
+  if (now_us() >= due(s)) {
+    let_go(s);
+    s->flushing = 1;
+    return n;
+  }
+  return n - tail;
+}
+
+/* Work out what each side waits for, and whether the session is
+   done.  Returns 0 if the session was closed. */
+static int update(struct session *s)
+{
+  unsigned tcp = 0, chaos = 0;
+
+  /* Once a side that hung up has been read to the end, nothing more
+     can be sent to it. */
+  if (s->chaos.hup && s->chaos_eof) {
+    s->tcp_eof = s->chaos_shut = 1;
+    s->in.start = s->in.end;
+  }
+  if (s->tcp.hup && s->tcp_eof) {
+    s->chaos_eof = s->tcp_shut = 1;
+    s->out.start = s->out.end;
+  }
+
+  if (s->tcp_eof && buffered(&s->in) == 0 && !s->chaos_shut) {
+    shutdown(s->chaos.fd, SHUT_WR);
+    s->chaos_shut = 1;
+  }
+  if (s->chaos_eof && buffered(&s->out) == 0 && !s->tcp_shut) {
+    shutdown(s->tcp.fd, SHUT_WR);
+    s->tcp_shut = 1;
+  }
+  if (s->tcp_shut && s->chaos_shut) {
+    disconnect(s, "connection closed", 0);
+    return 0;
+  }
+
+  /* Only read a side when there's room to keep what it sends. */
+  if (!s->tcp_eof && room(&s->in) > 0)
+    tcp |= EPOLLIN;
+  if (buffered(&s->out) > 0)
+    tcp |= EPOLLOUT;
+  if (!s->chaos_eof && room(&s->out) > 0)
+    chaos |= EPOLLIN;
+  if (ready(s) > 0)
+    chaos |= EPOLLOUT;
+  interest(&s->tcp, tcp);
+  interest(&s->chaos, chaos);
+  return 1;
+}
+
+static void set_option(int fd, int level, int name, int value)
+{
+  setsockopt(fd, level, name, &value, sizeof value);
+}
+
+/* Set the TCP socket up for keystrokes or for bulk data. */
+static void set_profile(struct session *s, int bulk)
+{
+  int fd = s->tcp.fd;
+
+  set_option(fd, IPPROTO_TCP, TCP_NODELAY, !bulk);
+  set_option(fd, IPPROTO_TCP, TCP_CORK, bulk);
+  if (bulk) {
+    set_option(fd, SOL_SOCKET, SO_SNDBUF, buffer_size);
+    set_option(fd, SOL_SOCKET, SO_RCVBUF, buffer_size);
+  } else {
+    /* Notice a terminal that's gone within a few minutes, rather
+       than leave its job logged in for hours. */
+    set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, 120);
+    set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, 30);
+    set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, 4);
+  }
+  s->bulk = bulk;
+  s->pushed = s->from_chaos;
+}
+
+/* Send what's corked once the buffer to TCP is empty. */
+static void push(struct session *s)
+{
+  if (!s->bulk || buffered(&s->out) > 0 || s->pushed == s->from_chaos)
+    return;
+  set_option(s->tcp.fd, IPPROTO_TCP, TCP_CORK, 0);
+  set_option(s->tcp.fd, IPPROTO_TCP, TCP_CORK, 1);
+  s->pushed = s->from_chaos;
+}
+
+/* Pick the profile from a running average of the read sizes. */
+static void observe(struct session *s, ssize_t n)
+{
+  if (s->mapping->profile != AUTOMATIC)
+    return;
+  s->average += (n - s->average) / 8;
+  if (!s->bulk && s->average >= BULK_READ)
+    set_profile(s, 1);
+  else if (s->bulk && s->average < SMALL_READ)
+    set_profile(s, 0);
+}
+
+/* Move data from one socket to the other, through a buffer. */
+static int transfer(struct session *s, int from, int to, struct buffer *b,
+                    int *eof, unsigned long long *bytes,
+                    unsigned long long *total)
+{
+  ssize_t n;
+
+  if (!*eof && room(b) > 0) {
+    n = fill(from, b);
+    if (n == 0)
+      *eof = 1;
+    else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      disconnect(s, "read error", errno);
+      return 0;
+    } else if (n > 0) {
+      CHAOS_PROBE3(copy, from, to, n);
+      *bytes += n;
+      count(total, n);
+      observe(s, n);
+      if (b == &s->in)
+        s->last = now_us();
+    }
+  }
+
+  if (drain(to, b, b == &s->in ? ready(s) : buffered(b)) < 0) {
+    disconnect(s, "write error", errno);
+    return 0;
+  }
+  return 1;
+}
+
+static int is_down(struct mapping *m, int i)
+{
+  struct backend *b = &m->backend[i];
+  return b->down && (m->check > 0 || now_ms() < b->down_until);
+}
+
+static void host_down(struct mapping *m, int i, const char *why)
+{
+  struct backend *b = &m->backend[i];
+  if (!is_down(m, i))
+    fprintf(stderr, "Host %s is down: %s\n", m->hosts[i], why);
+  b->down = 1;
+  b->down_until = now_ms() + EJECT;
+}
+
+static void host_up(struct mapping *m, int i)
+{
+  struct backend *b = &m->backend[i];
+  if (b->down)
+    fprintf(stderr, "Host %s is up\n", m->hosts[i]);
+  b->down = 0;
+}
+
+static void opened(struct session *s, int i)
+{
+  struct mapping *m = s->mapping;
+  int host = s->racer[i].host;
+
+  s->chaos.fd = s->racer[i].rfc.fd;
+  s->racer[i].rfc.fd = -1;
+  s->host = host;
+  s->racer[i].host = -1;
+  stop_racing(s);
+  host_up(m, host);
+  fprintf(stderr, "Opened connection to %s contact %s\n",
+          m->hosts[host], m->contact);
+  CHAOS_PROBE3(connection__open, s->tcp.fd, s->chaos.fd, m->hosts[host]);
+  if (buffer_init(&s->in) < 0 || buffer_init(&s->out) < 0) {
+    disconnect(s, "out of memory", 0);
+    return;
+  }
+  update(s);
+}
+
+/* Choose the next host to ask: one that's up before one that's
+   down, and then by the mapping's policy. */
+static int pick(struct session *s)
+{
+  struct mapping *m = s->mapping;
+  int i, k, best = -1, start = 0;
+
+  if (m->balance != RACE)
+    start = m->turn;
+  for (k = 0; k < m->nhosts; k++) {
+    i = (start + k) % m->nhosts;
+    if (s->tried & (1u << i))
+      continue;
+    if (best < 0 || is_down(m, best) > is_down(m, i)
+        || (is_down(m, best) == is_down(m, i) && m->balance == FEWEST
+            && m->backend[i].sessions < m->backend[best].sessions))
+      best = i;
+  }
+  if (s->started == 0)
+    m->turn = (m->turn + 1) % m->nhosts;
+  return best;
+}
+
+static void start_rfc(struct session *s)
+{
+  struct mapping *m = s->mapping;
+  int i = pick(s);
+  struct racer *r = &s->racer[s->started++];
+  int seconds = m->timeout >= 0 ? m->timeout : timeout;
+
+  s->tried |= 1u << i;
+  r->host = -1;
+  r->watch.what = RFC;
+  r->watch.session = s;
+  r->watch.index = r - s->racer;
+  r->watch.events = 0;
+  if (chaos_rfc_start(&r->rfc, m->backend[i].address, m->contact, NULL, 0,
+                      seconds > 0 ? seconds * 1000 : -1) < 0) {
+    fprintf(stderr, "Host %s: %s %s\n", s->peer, m->hosts[i],
+            strerror(errno));
+    r->watch.fd = -1;
+    chaos_rfc_abort(&r->rfc);
+  } else {
+    r->host = i;
+    m->backend[i].sessions++;
+    r->watch.fd = r->rfc.fd;
+    watch(&r->watch, r->rfc.events);
+    s->active++;
+  }
+  s->next_start = now_ms() + CHAOS_RFC_STAGGER;
+}
+
+/* Start a request to the next host when it's time, or when the
+   others have failed.  Returns 0 if the session was closed. */
+static int race(struct session *s)
+{
+  while (s->started < s->mapping->nhosts
+         && (s->active == 0 || now_ms() >= s->next_start))
+    start_rfc(s);
+  if (s->active == 0) {
+    disconnect(s, "no host answered", 0);
+    return 0;
+  }
+  return 1;
+}
+
+/* Take an answer, or the lack of one by the deadline.  Returns 0 if
+   the session was closed. */
+static int rfc_event(struct session *s, int i)
+{
+  struct racer *r = &s->racer[i];
+  int x = chaos_rfc_poll(&r->rfc);
+  const char *why;
+
+  if (x == 0) {
+    watch(&r->watch, r->rfc.events);
+    return 1;
+  }
+  if (x == CHOP_OPN) {
+    opened(s, i);
+    return 1;
+  }
+  why = x < 0 ? strerror(errno) : r->rfc.reason;
+  fprintf(stderr, "Host %s: %s %s\n", s->peer, s->mapping->hosts[r->host],
+          why);
+  /* A CLS is the server's answer, e.g. that it's busy, and says the
+     host is up; no answer, or a LOS, says it isn't. */
+  if (x < 0 || x == CHOP_LOS)
+    host_down(s->mapping, r->host, why);
+  s->mapping->backend[r->host].sessions--;
+  r->host = -1;
+  watch(&r->watch, 0);
+  chaos_rfc_abort(&r->rfc);
+  r->watch.fd = -1;
+  s->active--;
+  s->next_start = now_ms();
+  return race(s);
+}
+
+/* Say why a connection was turned away, but not more than once a
+   second in a flood. */
+static void refuse(struct mapping *m, const char *peer, const char *why)
+{
+  static long long last;
+  static int quiet;
+  long long now = now_ms();
+
+  if (now - last < 1000) {
+    quiet++;
+    return;
+  }
+  if (quiet > 0)
+    fprintf(stderr, "Refused %d more connections\n", quiet);
+  fprintf(stderr, "Refused connection from %s to %s %s: %s\n", peer,
+          m->reverse ? "contact" : "port", m->reverse ? m->contact : m->port,
+          why);
+  last = now;
+  quiet = 0;
+}
+
+/* Decide whether to take a new connection. */
+static const char *admit(struct mapping *m, struct source *x)
+{
+  if (max_sessions > 0 && total_sessions() >= max_sessions)
+    return "too many sessions";
+  if (m->max > 0 && m->sessions >= m->max)
+    return "too many sessions to this mapping";
+  if (max_source_sessions > 0 && x->sessions >= max_source_sessions)
+    return "too many sessions from this address";
+  if (!allow(&rate, max_rate))
+    return "too many new connections";
+  if (!allow(&x->rate, max_source_rate))
+    return "too many new connections from this address";
+  return NULL;
+}
+
+/* Make a session for a connection from peer, if it's let in.
+   Returns NULL and says why if not. */
+static struct session *new_session(struct mapping *m, const char *peer,
+                                   const char **why)
+{
+  struct session *s;
+  struct source *x;
+
+  x = find_source(peer);
+  *why = x == NULL ? "out of memory" : admit(m, x);
+  if (*why != NULL) {
+    count(&stats->refused, 1);
+    refuse(m, peer, *why);
+    return NULL;
+  }
+
+  s = calloc(1, sizeof *s);
+  if (s != NULL && !m->reverse)
+    s->racer = calloc(m->nhosts, sizeof *s->racer);
+  if (s == NULL || (!m->reverse && s->racer == NULL)) {
+    fprintf(stderr, "Out of memory\n");
+    free(s);
+    *why = "out of memory";
+    return NULL;
+  }
+
+  s->mapping = m;
+  m->sessions++;
+  s->source = x;
+  x->sessions++;
+  __atomic_fetch_add(&stats->sessions, 1, __ATOMIC_RELAXED);
+  count(&stats->connections, 1);
+  s->tcp.what = TCP;
+  s->tcp.fd = -1;
+  s->tcp.session = s;
+  s->chaos.what = CHAOS;
+  s->chaos.fd = -1;
+  s->chaos.session = s;
+  s->in.pipe[0] = s->in.pipe[1] = -1;
+  s->out.pipe[0] = s->out.pipe[1] = -1;
+  s->host = -1;
+  snprintf(s->peer, sizeof s->peer, "%s", peer);
+  return s;
+}
+
+static void connection(struct mapping *m, int fd,
+                       const struct sockaddr_storage *addr)
+{
+  char peer[INET6_ADDRSTRLEN] = "";
+  const char *why;
+  struct session *s;
+
+  if (addr->ss_family == AF_INET)
+    inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr,
+              peer, sizeof peer);
+  else if (addr->ss_family == AF_INET6)
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr,
+              peer, sizeof peer);
+
+  s = new_session(m, peer, &why);
+  if (s == NULL) {
+    close(fd);
+    return;
+  }
+  s->tcp.fd = fd;
+  set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+  set_profile(s, m->profile == BULK);
+  fprintf(stderr, "Incoming connection from %s to port %s\n",
+          s->peer, m->port);
+
+  /* Hear about errors while the request is made. */
+  watch(&s->tcp, EPOLLERR);
+  link_session(&connecting, s);
+  race(s);
+}
+
+/* Take what's waiting in the accept queue, up to a batch so other
+   work isn't held up. */
+static void incoming(struct mapping *m)
+{
+  struct sockaddr_storage addr;
+  socklen_t len;
+  int i, fd;
+
+  for (i = 0; i < ACCEPT_BATCH; i++) {
+    len = sizeof addr;
+    fd = accept4(m->listener.fd, (struct sockaddr *)&addr, &len,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        fprintf(stderr, "Error calling accept: %s\n", strerror(errno));
+      return;
+    }
+    connection(m, fd, &addr);
+  }
+}
+
+/* Try again later, saying why only the first time. */
+static void retry_later(struct mapping *m, const char *what, int error)
+{
+  if (!m->failing)
+    fprintf(stderr, "Contact %s: error %s: %s\n", m->contact, what,
+            strerror(error));
+  m->failing = 1;
+  if (m->retry == 0)
+    m->retry = now_ms() + RETRY;
+}
+
+/* Ask the NCP for the next RFC to a reverse mapping's contact. */
+static void open_lsn(struct mapping *m, int i)
+{
+  struct lsn *l = &m->lsn[i];
+  char line[MAX_PACKET + 8];
+  int fd, n;
+
+  l->len = 0;
+  l->watch.what = LSN;
+  l->watch.mapping = m;
+  l->watch.index = i;
+  l->watch.events = 0;
+  l->watch.fd = -1;
+
+  n = snprintf(line, sizeof line, "LSN %s\r\n", m->contact);
+  fd = chaos_stream();
+  if (fd >= 0 && write(fd, line, n) != n) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    retry_later(m, "listening to the NCP", errno);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  m->failing = 0;
+  l->watch.fd = fd;
+  watch(&l->watch, EPOLLIN);
+}
+
+/* Start connecting to the server of a reverse mapping. */
+static int dial(struct mapping *m)
+{
+  int fd, error;
+
+  fd = socket(m->server.ss_family,
+              SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&m->server, m->server_len) < 0
+      && errno != EINPROGRESS) {
+    error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+static void open_pooled(struct mapping *m, int i)
+{
+  struct pooled *p = &m->pool[i];
+
+  p->ready = 0;
+  p->watch.what = POOL;
+  p->watch.mapping = m;
+  p->watch.index = i;
+  p->watch.events = 0;
+  p->watch.fd = dial(m);
+  if (p->watch.fd < 0) {
+    retry_later(m, "connecting to the server", errno);
+    return;
+  }
+  watch(&p->watch, EPOLLOUT);
+}
+
+/* A pooled connection was made, or went away. */
+static void pool_event(struct mapping *m, int i, unsigned events)
+{
+  struct pooled *p = &m->pool[i];
+  socklen_t len = sizeof (int);
+  int error = 0;
+  ssize_t n;
+  char c;
+
+  if (!p->ready) {
+    /* Or an event left from the one before it. */
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+    getsockopt(p->watch.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error == 0) {
+      p->ready = 1;
+      m->failing = 0;
+      watch(&p->watch, EPOLLIN);
+      return;
+    }
+    unwatch(&p->watch);
+    retry_later(m, "connecting to the server", error);
+    return;
+  } else {
+    n = recv(p->watch.fd, &c, 1, MSG_PEEK);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    if (n > 0) {
+      /* The server speaks first.  That's for the client. */
+      watch(&p->watch, 0);
+      return;
+    }
+  }
+  /* Closed by the server; make another in a while. */
+  unwatch(&p->watch);
+  if (m->retry == 0)
+    m->retry = now_ms() + RETRY;
+}
+
+/* Take a connection from the pool, and start another. */
+static int take_pooled(struct mapping *m)
+{
+  struct pooled *p;
+  int i, fd;
+
+  for (i = 0; i < m->pooled; i++) {
+    p = &m->pool[i];
+    if (!p->ready)
+      continue;
+    fd = p->watch.fd;
+    watch(&p->watch, 0);
+    p->watch.fd = -1;
+    open_pooled(m, i);
+    return fd;
+  }
+  return -1;
+}
+
+/* Turn down an RFC. */
+static int decline(int fd, const char *why)
+{
+  char line[MAX_PACKET + 8];
+  int n = snprintf(line, sizeof line, "CLS %s\r\n", why);
+  return write(fd, line, n) == n ? 0 : -1;
+}
+
+/* Accept the RFC, now that there's a server to join it to. */
+static void answer(struct session *s)
+{
+  struct mapping *m = s->mapping;
+
+  s->dialing = 0;
+  if (write(s->chaos.fd, "OPN\r\n", 5) != 5) {
+    disconnect(s, "error answering", errno);
+    return;
+  }
+  set_option(s->tcp.fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+  set_profile(s, m->profile == BULK);
+  fprintf(stderr, "Opened connection to %s port %s\n", m->address, m->port);
+  CHAOS_PROBE3(connection__open, s->tcp.fd, s->chaos.fd, m->address);
+  if (buffer_init(&s->in) < 0 || buffer_init(&s->out) < 0) {
+    disconnect(s, "out of memory", 0);
+    return;
+  }
+  update(s);
+}
+
+static void dialed(struct session *s)
+{
+  socklen_t len = sizeof (int);
+  int error = 0;
+
+  getsockopt(s->tcp.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+  if (error != 0) {
+    decline(s->chaos.fd, strerror(error));
+    disconnect(s, "could not reach the server", error);
+    return;
+  }
+  answer(s);
+}
 
-static const char *argv0;
-static const char *port;
-static const char *contact;
-static const char *host;
-static char *peer;
-static int server;
-static char buffer[MAX_PACKET];
+/* An RFC to a reverse mapping, in a line like "RFC host args". */
+static void request(struct mapping *m, int fd, const char *line)
+{
+  char host[INET6_ADDRSTRLEN];
+  const char *why;
+  struct session *s;
 
-static void fatal(const char *message, int error)
+  if (strncmp(line, "RFC ", 4) != 0) {
+    fprintf(stderr, "Contact %s: %s\n", m->contact, line);
+    close(fd);
+    return;
+  }
+  snprintf(host, sizeof host, "%.*s", (int)strcspn(line + 4, " "),
+           line + 4);
+
+  s = new_session(m, host, &why);
+  if (s == NULL) {
+    decline(fd, why);
+    close(fd);
+    return;
+  }
+  s->chaos.fd = fd;
+  fprintf(stderr, "Incoming connection from %s to contact %s\n",
+          s->peer, m->contact);
+
+  s->tcp.fd = take_pooled(m);
+  if (s->tcp.fd >= 0) {
+    answer(s);
+    return;
+  }
+  s->tcp.fd = dial(m);
+  if (s->tcp.fd < 0) {
+    decline(fd, strerror(errno));
+    disconnect(s, "could not reach the server", errno);
+    return;
+  }
+  s->dialing = 1;
+  watch(&s->tcp, EPOLLOUT);
+}
+
+static void lsn_event(struct mapping *m, int i)
 {
-  fprintf(stderr, "Fatal error %s\n", message);
-  if (error)
-    fprintf(stderr, ": %s", strerror(error));
-  fputc('\n', stderr);
-  exit(1);
+  struct lsn *l = &m->lsn[i];
+  char line[sizeof l->line];
+  char *end;
+  ssize_t n;
+  int fd;
+
+  n = read(l->watch.fd, l->line + l->len, sizeof l->line - 1 - l->len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    unwatch(&l->watch);
+    retry_later(m, "listening to the NCP", n < 0 ? errno : ECONNRESET);
+    return;
+  }
+  l->len += n;
+  l->line[l->len] = 0;
+  end = strchr(l->line, '\n');
+  if (end == NULL) {
+    if (l->len == sizeof l->line - 1) {
+      unwatch(&l->watch);
+      open_lsn(m, i);
+    }
+    return;
+  }
+  *end = 0;
+  if (end > l->line && end[-1] == '\r')
+    end[-1] = 0;
+  strcpy(line, l->line);
+
+  /* Someone else listens while this one is served. */
+  fd = l->watch.fd;
+  watch(&l->watch, 0);
+  l->watch.fd = -1;
+  open_lsn(m, i);
+  request(m, fd, line);
 }
 
-static void disconnect(const char *message, int error, int code)
+/* Open what's missing of a reverse mapping's listeners and pool. */
+static void refill(struct mapping *m)
 {
-  fprintf(stderr, "Host %s %s\n", peer, message);
-  if (error)
-    fprintf(stderr, ": %s", strerror(error));
-  fputc('\n', stderr);
-  exit(code);
+  int i;
+  for (i = 0; i < m->listens; i++) {
+    if (m->lsn[i].watch.fd < 0)
+      open_lsn(m, i);
+  }
+  for (i = 0; i < m->pooled; i++) {
+    if (m->pool[i].watch.fd < 0)
+      open_pooled(m, i);
+  }
 }
 
-static void copy(int src, int dst)
+static void stop_reverse(struct mapping *m)
 {
-  ssize_t n = read(src, buffer, sizeof buffer);
-  if (n < 0)
-    disconnect("read error", errno, 1);
-  if (n == 0)
-    disconnect("connection closed", 0, 0);
-  if (write(dst, buffer, n) < 0)
-    disconnect("write error", errno, 1);
+  int i;
+
+  if (m->lsn != NULL) {
+    for (i = 0; i < m->listens; i++)
+      unwatch(&m->lsn[i].watch);
+    discard(m->lsn);
+    m->lsn = NULL;
+  }
+  if (m->pool != NULL) {
+    for (i = 0; i < m->pooled; i++)
+      unwatch(&m->pool[i].watch);
+    discard(m->pool);
+    m->pool = NULL;
+  }
 }
 
-static void forward(int s, int c)
+/* Start listening for a reverse mapping, taking over the listeners
+   and pool of the old one where they'd be the same. */
+static int start_reverse(struct mapping *m, struct mapping *old)
 {
-  struct pollfd pfd[2];
+  int i;
 
-  pfd[0].fd = s;
-  pfd[0].events = POLLIN|POLLERR|POLLHUP;
-  pfd[1].fd = c;
-  pfd[1].events = POLLIN|POLLERR|POLLHUP;
+  if (old != NULL && old->lsn != NULL && old->listens == m->listens) {
+    m->lsn = old->lsn;
+    old->lsn = NULL;
+    for (i = 0; i < m->listens; i++)
+      m->lsn[i].watch.mapping = m;
+  } else {
+    m->lsn = calloc(m->listens, sizeof *m->lsn);
+    if (m->lsn == NULL)
+      return -1;
+    for (i = 0; i < m->listens; i++)
+      m->lsn[i].watch.fd = -1;
+  }
 
-  for(;;) {
-    int x = poll(pfd, 2, 10*1000);
-    if (x < 0) {
-      fprintf(stderr, "Poll error: %s\n", strerror(errno));
-      continue;
+  if (old != NULL && old->pool != NULL && old->pooled == m->pooled
+      && same(old->address, m->address) && strcmp(old->port, m->port) == 0) {
+    m->pool = old->pool;
+    old->pool = NULL;
+    for (i = 0; i < m->pooled; i++)
+      m->pool[i].watch.mapping = m;
+  } else if (m->pooled > 0) {
+    m->pool = calloc(m->pooled, sizeof *m->pool);
+    if (m->pool == NULL) {
+      stop_reverse(m);
+      return -1;
     }
-    if (x == 0)
-      continue;
-    if (pfd[0].revents & POLLIN)
-      copy(pfd[0].fd, pfd[1].fd);
-    if (pfd[1].revents & POLLIN)
-      copy(pfd[1].fd, pfd[0].fd);
-    if ((pfd[0].revents | pfd[1].revents) & POLLERR)
-      disconnect("connection error", 0, 1);
-    if ((pfd[0].revents | pfd[1].revents) & POLLHUP)
-      disconnect("connection hung up", 0, 1);
+    for (i = 0; i < m->pooled; i++)
+      m->pool[i].watch.fd = -1;
+  }
+
+  refill(m);
+  return 0;
+}
+
+/* Ask a host for STATUS, or the mapping's contact, to see if it's
+   worth sending sessions to. */
+static void start_check(struct mapping *m, int i)
+{
+  struct backend *b = &m->backend[i];
+  int timeout = m->check * 1000 < CHECK_TIMEOUT
+    ? m->check * 1000 : CHECK_TIMEOUT;
+
+  b->next_check = now_ms() + m->check * 1000;
+  b->watch.what = CHECK;
+  b->watch.mapping = m;
+  b->watch.index = i;
+  b->watch.events = 0;
+  if (chaos_rfc_start(&b->probe, b->address,
+                      m->probe ? m->probe : "STATUS", NULL, 0, timeout) < 0) {
+    host_down(m, i, strerror(errno));
+    b->watch.fd = -1;
+    chaos_rfc_abort(&b->probe);
+    return;
+  }
+  b->watch.fd = b->probe.fd;
+  watch(&b->watch, b->probe.events);
+}
+
+static void stop_check(struct backend *b)
+{
+  watch(&b->watch, 0);
+  chaos_rfc_abort(&b->probe);
+  b->watch.fd = -1;
+}
+
+static void check_event(struct mapping *m, int i)
+{
+  struct backend *b = &m->backend[i];
+  int x = chaos_rfc_poll(&b->probe);
+
+  if (x == 0) {
+    watch(&b->watch, b->probe.events);
+    return;
+  }
+  if (x < 0 || x == CHOP_LOS)
+    host_down(m, i, x < 0 ? strerror(errno) : b->probe.reason);
+  else
+    host_up(m, i);
+  stop_check(b);
+}
+
+static void stop_checks(struct mapping *m)
+{
+  int i;
+
+  for (i = 0; i < m->nhosts; i++) {
+    if (m->backend[i].watch.fd >= 0)
+      stop_check(&m->backend[i]);
   }
 }
 
-static void incoming(void)
+static void event(struct watch *w, unsigned events)
 {
-  struct sockaddr addr;
-  socklen_t len = sizeof addr;
-  int s, c;
+  struct session *s = w->session;
+
+  /* Closed by an earlier event in this batch. */
+  if (w->fd < 0)
+    return;
+
+  switch (w->what) {
+  case LISTENER:
+    incoming(w->mapping);
+    return;
+  case RFC:
+    rfc_event(s, w->index);
+    return;
+  case LSN:
+    lsn_event(w->mapping, w->index);
+    return;
+  case POOL:
+    pool_event(w->mapping, w->index, events);
+    return;
+  case CHECK:
+    check_event(w->mapping, w->index);
+    return;
+  }
 
-  s = accept(server, &addr, &len);
-  if (s < 0) {
-    fprintf(stderr, "Error calling accept: %s\n", strerror(errno));
+  if (s->dialing) {
+    dialed(s);
     return;
   }
 
-  if (fork()) {
-    close(s);
+  if (s->racer != NULL) {
+    /* Still connecting, so this is an error. */
+    disconnect(s, "hung up before the connection opened", 0);
     return;
   }
 
-  if (addr.sa_family == AF_INET) {
-    struct sockaddr_in *x = (struct sockaddr_in *)&addr;
-    peer = inet_ntoa(x->sin_addr);
-    fprintf(stderr, "Incoming connection from %s to port %s\n", peer, port);
+  if (events & EPOLLERR) {
+    disconnect(s, "connection error", 0);
+    return;
+  }
+  if (events & EPOLLHUP)
+    w->hup = 1;
+  if (!transfer(s, s->tcp.fd, s->chaos.fd, &s->in, &s->tcp_eof,
+                &s->to_chaos, &stats->to_chaos))
+    return;
+  if (!transfer(s, s->chaos.fd, s->tcp.fd, &s->out, &s->chaos_eof,
+                &s->from_chaos, &stats->from_chaos))
+    return;
+  push(s);
+  update(s);
+}
+
+/* When a request for connection is due to time out, or to connect
+   again to a busy NCP, in milliseconds, or -1. */
+static long long rfc_due(const struct chaos_rfc *rfc)
+{
+  int t = chaos_rfc_timeout(rfc);
+  return t < 0 ? -1 : now_ms() + t;
+}
+
+/* Microseconds until a racing request is due to start another or
+   to give up on a host, or held data is due to be sent, or
+   listeners are to be opened, or a host is to be checked. */
+static long long next_timeout(void)
+{
+  long long now = now_us(), t = -1;
+  long long x;
+  struct mapping *m;
+  struct session *s;
+  int i;
+
+  /* Keep the earliest time, then subtract, so a timer that's
+     already overdue isn't taken for none at all. */
+  for (s = connecting; s != NULL; s = s->next) {
+    for (i = 0; i < s->started; i++) {
+      if (s->racer[i].watch.fd >= 0
+          && (x = rfc_due(&s->racer[i].rfc)) >= 0 && (t < 0 || x * 1000 < t))
+        t = x * 1000;
+    }
+    if (s->started < s->mapping->nhosts
+        && (t < 0 || s->next_start * 1000 < t))
+      t = s->next_start * 1000;
+  }
+  for (s = holding; s != NULL; s = s->next) {
+    if (t < 0 || due(s) < t)
+      t = due(s);
+  }
+  for (m = mappings; m != NULL; m = m->next) {
+    if (m->retry != 0 && (t < 0 || m->retry * 1000 < t))
+      t = m->retry * 1000;
+    for (i = 0; m->check > 0 && i < m->nhosts; i++) {
+      if (m->backend[i].watch.fd >= 0) {
+        x = rfc_due(&m->backend[i].probe);
+        if (t < 0 || x * 1000 < t)
+          t = x * 1000;
+      } else if (t < 0 || m->backend[i].next_check * 1000 < t)
+        t = m->backend[i].next_check * 1000;
+    }
+  }
+  return t < 0 ? -1 : t > now ? t - now : 0;
+}
+
+static void timers(void)
+{
+  struct session *s, *next;
+  struct mapping *m;
+  struct backend *b;
+  struct racer *r;
+  long long now = now_ms();
+  int i, alive;
+
+  for (s = connecting; s != NULL; s = next) {
+    next = s->next;
+    alive = 1;
+    for (i = 0; alive && i < s->started; i++) {
+      r = &s->racer[i];
+      if (r->watch.fd >= 0 && rfc_due(&r->rfc) >= 0
+          && now >= rfc_due(&r->rfc))
+        alive = rfc_event(s, i);
+    }
+    if (alive && s->started < s->mapping->nhosts && now >= s->next_start)
+      race(s);
+  }
+  for (s = holding; s != NULL; s = next) {
+    next = s->next;
+    if (now_us() >= due(s))
+      update(s);
+  }
+  for (m = mappings; m != NULL; m = m->next) {
+    if (m->retry != 0 && now >= m->retry) {
+      m->retry = 0;
+      refill(m);
+    }
+    for (i = 0; m->check > 0 && i < m->nhosts; i++) {
+      b = &m->backend[i];
+      if (b->watch.fd >= 0 && now >= rfc_due(&b->probe))
+        check_event(m, i);
+      else if (b->watch.fd < 0 && now >= b->next_check)
+        start_check(m, i);
+    }
+  }
+}
+
+/* Wait for events or the next timer, to the microsecond where the
+   kernel can. */
+static int wait_events(struct epoll_event *ev)
+{
+  static int coarse;
+  long long t = next_timeout();
+  struct timespec ts;
+  int n;
+
+  if (!coarse) {
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = t % 1000000 * 1000;
+    n = epoll_pwait2(epoll, ev, MAX_EVENTS, t < 0 ? NULL : &ts, &waitmask);
+    if (n >= 0 || errno != ENOSYS)
+      return n;
+    coarse = 1;
   }
+  return epoll_pwait(epoll, ev, MAX_EVENTS,
+                     t < 0 ? -1 : (int)((t + 999) / 1000), &waitmask);
+}
 
-  c = chaos_stream();
-  if (c < 0)
-    fatal("creating Chaosnet stream", errno);
+/* Set the queue length, and how long the kernel holds a connection
+   before handing it over if the client hasn't sent anything. */
+static void tune_listener(struct mapping *m)
+{
+  int seconds = m->defer >= 0 ? m->defer : defer;
 
-  if (chaos_stream_rfc(c, host, contact) < 0)
-    fatal("error during request for connection", errno);
-  fprintf(stderr, "Opened connection to %s contact %s\n", host, contact);
-  forward(s, c);
+  listen(m->listener.fd, backlog);
+  if (setsockopt(m->listener.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                 &seconds, sizeof seconds) < 0)
+    fprintf(stderr, "Port %s: TCP_DEFER_ACCEPT: %s\n", m->port,
+            strerror(errno));
 }
 
-static void serve(void)
+/* Listen to the port of a mapping.  Returns -1 on error. */
+static int open_listener(struct mapping *m)
 {
   struct addrinfo hints;
   struct addrinfo *addr;
   struct addrinfo *rp;
   int reuse = 1;
+  int fd = -1, x;
 
   memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_INET;
+  hints.ai_family = m->address ? AF_UNSPEC : AF_INET;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE;
 
-  if (getaddrinfo(NULL, port, &hints, &addr) != 0)
-    fatal("calling getaddrinfo", errno);
+  x = getaddrinfo(m->address, m->port, &hints, &addr);
+  if (x != 0) {
+    fprintf(stderr, "Port %s: %s\n", m->port, gai_strerror(x));
+    return -1;
+  }
 
   for (rp = addr; rp != NULL; rp = rp->ai_next) {
-    server = socket(rp->ai_family, rp->ai_socktype, 0);
-    if (server < 0)
-      fatal("creating socket", errno);
+    fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    if (jobs > 1)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse);
+    if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0
+        && listen(fd, backlog) == 0)
+      break;
+    fprintf(stderr, "Bind port %s: %s\n", m->port, strerror(errno));
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addr);
+  if (fd < 0)
+    return -1;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  m->listener.fd = fd;
+  tune_listener(m);
+  watch(&m->listener, EPOLLIN);
+  return 0;
+}
 
-    if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse) < 0)
-      fatal("calling setsockopt", errno);
+static struct mapping *new_mapping(const char *address, const char *port,
+                                   const char *contact, const char *hosts)
+{
+  struct mapping *m = calloc(1, sizeof *m);
+  struct backend *b;
+  int i;
+
+  if (m == NULL)
+    return NULL;
+  m->listener.what = LISTENER;
+  m->listener.fd = -1;
+  m->listener.mapping = m;
+  for (i = 0; i < CHAOS_MAX_HOSTS; i++)
+    m->backend[i].watch.fd = -1;
+  m->defer = -1;
+  m->profile = profile;
+  m->coalesce = -1;
+  m->timeout = -1;
+  m->address = address ? strdup(address) : NULL;
+  m->port = strdup(port);
+  m->contact = strdup(contact);
+  m->list = hosts ? strdup(hosts) : NULL;
+  if ((address && !m->address) || !m->port || !m->contact
+      || (hosts && !m->list)) {
+    free_mapping(m);
+    return NULL;
+  }
+  if (hosts)
+    m->nhosts = chaos_host_list(m->list, m->hosts, CHAOS_MAX_HOSTS + 1);
+  /* Requests for connection don't wait for a name to be looked up,
+     so look them up now, and keep the addresses even if there's no
+     cache to hold them.  They're looked up again on SIGHUP. */
+  for (i = 0; i < m->nhosts; i++) {
+    b = &m->backend[i];
+    b->address = chaos_host_resolve(m->hosts[i], b->number,
+                                    sizeof b->number);
+  }
+  return m;
+}
+
+static int find_profile(const char *name)
+{
+  int i;
+  for (i = 0; i <= AUTOMATIC; i++) {
+    if (strcmp(name, profile_name[i]) == 0)
+      return i;
+  }
+  return -1;
+}
 
-    if (bind(server, rp->ai_addr, rp->ai_addrlen) == 0)
-      goto ok;
-    fprintf(stderr, "Bind: %s\n", strerror(errno));
+static int find_balance(const char *name)
+{
+  int i;
+  for (i = 0; i <= FEWEST; i++) {
+    if (strcmp(name, balance_name[i]) == 0)
+      return i;
   }
-  fatal("binding socket", 0);
+  return -1;
+}
+
+/* Find the server of a reverse mapping. */
+static int resolve(struct mapping *m, const char *where)
+{
+  struct addrinfo hints;
+  struct addrinfo *addr;
+  int x;
 
- ok:
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  x = getaddrinfo(m->address, m->port, &hints, &addr);
+  if (x != 0) {
+    fprintf(stderr, "%s: %s: %s\n", where, m->address, gai_strerror(x));
+    return -1;
+  }
+  memcpy(&m->server, addr->ai_addr, addr->ai_addrlen);
+  m->server_len = addr->ai_addrlen;
   freeaddrinfo(addr);
+  return 0;
+}
+
+/* A line of the configuration file:
+     [address:]port contact host[,host...] [max=N] [defer=N]
+       [profile=interactive|bulk|auto] [coalesce=microseconds]
+       [balance=race|rr|least] [check=seconds] [probe=status|rfc]
+       [timeout=seconds]
+   or for a reverse mapping:
+     reverse contact host:port [max=N] [listen=N] [pool=N]
+       [profile=interactive|bulk|auto] [coalesce=microseconds]
+   An IPv6 address goes in brackets. */
+static struct mapping *parse_mapping(char *line, const char *where)
+{
+  char *words[12], *address = NULL, *port, *p;
+  struct mapping *m;
+  int i, n = 0, reverse;
+
+  for (p = strtok(line, " \t\r\n"); p != NULL && n < 12;
+       p = strtok(NULL, " \t\r\n"))
+    words[n++] = p;
+  if (n < 3) {
+    fprintf(stderr, "%s: expected %s\n", where,
+            n > 0 && strcmp(words[0], "reverse") == 0
+            ? "contact and server" : "port, contact, and hosts");
+    return NULL;
+  }
+  reverse = strcmp(words[0], "reverse") == 0;
+
+  port = words[reverse ? 2 : 0];
+  p = strrchr(port, ':');
+  if (p != NULL) {
+    *p = 0;
+    address = port;
+    port = p + 1;
+    if (*address == '[' && address[strlen(address) - 1] == ']') {
+      address[strlen(address) - 1] = 0;
+      address++;
+    }
+  }
+  if (reverse && address == NULL) {
+    fprintf(stderr, "%s: expected host:port\n", where);
+    return NULL;
+  }
+
+  m = new_mapping(address, port, words[1], reverse ? NULL : words[2]);
+  if (m == NULL) {
+    fprintf(stderr, "%s: out of memory\n", where);
+    return NULL;
+  }
+  if (reverse) {
+    m->reverse = 1;
+    m->listens = REVERSE_LISTEN;
+  } else if (m->nhosts < 0) {
+    fprintf(stderr, "%s: more than %d hosts\n", where, CHAOS_MAX_HOSTS);
+    free_mapping(m);
+    return NULL;
+  } else if (m->nhosts == 0) {
+    fprintf(stderr, "%s: no hosts\n", where);
+    free_mapping(m);
+    return NULL;
+  }
+  for (i = 3; i < n; i++) {
+    if (strncmp(words[i], "max=", 4) == 0 && atoi(words[i] + 4) > 0)
+      m->max = atoi(words[i] + 4);
+    else if (strncmp(words[i], "defer=", 6) == 0 && !reverse
+             && atoi(words[i] + 6) >= 0)
+      m->defer = atoi(words[i] + 6);
+    else if (strncmp(words[i], "listen=", 7) == 0 && reverse
+             && atoi(words[i] + 7) > 0
+             && atoi(words[i] + 7) <= CHAOS_MAX_LISTEN)
+      m->listens = atoi(words[i] + 7);
+    else if (strncmp(words[i], "pool=", 5) == 0 && reverse
+             && atoi(words[i] + 5) >= 0 && atoi(words[i] + 5) <= MAX_POOL)
+      m->pooled = atoi(words[i] + 5);
+    else if (strncmp(words[i], "profile=", 8) == 0
+             && (m->profile = find_profile(words[i] + 8)) >= 0)
+      ;
+    else if (strncmp(words[i], "coalesce=", 9) == 0
+             && atoi(words[i] + 9) >= 0)
+      m->coalesce = atoi(words[i] + 9);
+    else if (strncmp(words[i], "balance=", 8) == 0 && !reverse
+             && (m->balance = find_balance(words[i] + 8)) >= 0)
+      ;
+    else if (strncmp(words[i], "check=", 6) == 0 && !reverse
+             && atoi(words[i] + 6) >= 0)
+      m->check = atoi(words[i] + 6);
+    else if (strncmp(words[i], "timeout=", 8) == 0 && !reverse
+             && atoi(words[i] + 8) >= 0)
+      m->timeout = atoi(words[i] + 8);
+    else if (strcmp(words[i], "probe=status") == 0 && !reverse)
+      m->probe = NULL;
+    else if (strcmp(words[i], "probe=rfc") == 0 && !reverse)
+      m->probe = m->contact;
+    else {
+      fprintf(stderr, "%s: bad option %s\n", where, words[i]);
+      free_mapping(m);
+      return NULL;
+    }
+  }
+  if (reverse && resolve(m, where) < 0) {
+    free_mapping(m);
+    return NULL;
+  }
+  return m;
+}
+
+static void free_list(struct mapping *list)
+{
+  struct mapping *next;
+  for (; list != NULL; list = next) {
+    next = list->next;
+    free_mapping(list);
+  }
+}
+
+/* Read the configuration file.  Returns NULL if anything is wrong
+   with it. */
+static struct mapping *read_config(const char *file)
+{
+  struct mapping *list = NULL, **tail = &list, *m;
+  char line[500], where[300], *p;
+  int number = 0, error = 0;
+  FILE *f;
+
+  f = fopen(file, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", file, strerror(errno));
+    return NULL;
+  }
+  while (fgets(line, sizeof line, f) != NULL) {
+    number++;
+    p = strchr(line, '#');
+    if (p != NULL)
+      *p = 0;
+    if (line[strspn(line, " \t\r\n")] == 0)
+      continue;
+    snprintf(where, sizeof where, "%s:%d", file, number);
+    m = parse_mapping(line, where);
+    if (m == NULL) {
+      error = 1;
+      continue;
+    }
+    *tail = m;
+    tail = &m->next;
+  }
+  fclose(f);
+
+  if (list == NULL && !error)
+    fprintf(stderr, "No ports in %s\n", file);
+  if (list == NULL || error) {
+    free_list(list);
+    return NULL;
+  }
+  return list;
+}
+
+/* Switch to a new set of mappings.  A port that's in both keeps its
+   listening socket, so no connection to it is refused meanwhile. */
+static void configure(struct mapping *list)
+{
+  struct mapping *m, *old, *next;
+
+  for (m = list; m != NULL; m = m->next) {
+    if (m->reverse) {
+      for (old = mappings; old != NULL; old = old->next) {
+        if (old->reverse && strcmp(old->contact, m->contact) == 0)
+          break;
+      }
+      if (start_reverse(m, old) == 0)
+        m->configured = 1;
+      continue;
+    }
+    for (old = mappings; old != NULL; old = old->next) {
+      if (old->listener.fd >= 0 && same(old->address, m->address)
+          && strcmp(old->port, m->port) == 0)
+        break;
+    }
+    if (old != NULL) {
+      watch(&old->listener, 0);
+      m->listener.fd = old->listener.fd;
+      old->listener.fd = -1;
+      tune_listener(m);
+      watch(&m->listener, EPOLLIN);
+    } else if (open_listener(m) < 0)
+      continue;
+    m->configured = 1;
+  }
+
+  for (old = mappings; old != NULL; old = next) {
+    next = old->next;
+    old->configured = 0;
+    unwatch(&old->listener);
+    stop_reverse(old);
+    stop_checks(old);
+    release(old);
+  }
+
+  /* Keep the ones that work. */
+  mappings = NULL;
+  for (m = list; m != NULL; m = next) {
+    next = m->next;
+    if (m->configured) {
+      m->next = mappings;
+      mappings = m;
+    } else
+      free_mapping(m);
+  }
+}
+
+static void note(int sig)
+{
+  switch (sig) {
+  case SIGHUP:  reload = 1; break;
+  case SIGUSR1: report = 1; break;
+  case SIGCHLD: exited = 1; break;
+  default:      stopping = sig; break;
+  }
+}
+
+static void print_stats(const char *who, const struct stats *x)
+{
+  fprintf(stderr, "%s: %ld sessions, %lu connections, %lu refused, "
+          "%llu bytes to Chaos, %llu from Chaos\n", who,
+          __atomic_load_n(&x->sessions, __ATOMIC_RELAXED),
+          __atomic_load_n(&x->connections, __ATOMIC_RELAXED),
+          __atomic_load_n(&x->refused, __ATOMIC_RELAXED),
+          __atomic_load_n(&x->to_chaos, __ATOMIC_RELAXED),
+          __atomic_load_n(&x->from_chaos, __ATOMIC_RELAXED));
+}
+
+static void reconfigure(void)
+{
+  struct mapping *list;
+
+  reload = 0;
+  fprintf(stderr, "Reading %s\n", config);
+  list = read_config(config);
+  if (list == NULL) {
+    fprintf(stderr, "Keeping the old configuration\n");
+    return;
+  }
+  configure(list);
+}
+
+static void serve(struct mapping *list)
+{
+  struct epoll_event ev[MAX_EVENTS];
+  int i, n;
+
+  epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0)
+    fatal("creating epoll", errno);
+  configure(list);
+  if (mappings == NULL)
+    fatal("binding socket", 0);
+
+  for (;;) {
+    n = wait_events(ev);
+    if (n < 0 && errno != EINTR)
+      fatal("waiting for events", errno);
+    for (i = 0; i < n; i++)
+      event(ev[i].data.ptr, ev[i].events);
+    timers();
+    collect();
+    if (reload) {
+      reconfigure();
+      collect();
+    }
+    if (report) {
+      report = 0;
+      print_stats(jobs > 1 ? "Worker" : "Gateway", stats);
+    }
+  }
+}
+
+/* Each session holds two sockets and up to two pipes, so the usual
+   soft limit of 1024 descriptors runs out long before the event loop
+   does.  Take as many as the hard limit allows. */
+static void raise_file_limit(void)
+{
+  struct rlimit r;
+
+  if (getrlimit(RLIMIT_NOFILE, &r) < 0 || r.rlim_cur >= r.rlim_max)
+    return;
+  r.rlim_cur = r.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &r) < 0)
+    fprintf(stderr, "Error raising the file limit: %s\n", strerror(errno));
+}
+
+/* Run a worker on the i-th CPU it's allowed. */
+static void pin_cpu(int i)
+{
+  cpu_set_t allowed, one;
+  int cpu, n = 0;
+
+  if (sched_getaffinity(0, sizeof allowed, &allowed) < 0)
+    return;
+  i %= CPU_COUNT(&allowed);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && n++ == i)
+      break;
+  }
+  CPU_ZERO(&one);
+  CPU_SET(cpu, &one);
+  if (sched_setaffinity(0, sizeof one, &one) < 0)
+    fprintf(stderr, "Error pinning worker to CPU %d: %s\n", cpu,
+            strerror(errno));
+}
+
+static void start_worker(int i, struct mapping *list)
+{
+  struct mapping *fresh;
+  pid_t parent = getpid();
+  sigset_t set;
+
+  workers[i] = fork();
+  if (workers[i] < 0) {
+    fprintf(stderr, "Error starting worker: %s\n", strerror(errno));
+    return;
+  }
+  if (workers[i] > 0)
+    return;
+
+  /* Go when the parent does. */
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != parent)
+    exit(0);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+  stats = &all_stats[i];
+  memset(stats, 0, sizeof *stats);
+  if (pin)
+    pin_cpu(i);
+  /* A worker started again picks up the latest configuration. */
+  if (config != NULL && (fresh = read_config(config)) != NULL) {
+    free_list(list);
+    list = fresh;
+  }
+  serve(list);
+}
+
+static void stop_workers(int sig)
+{
+  int i;
+  for (i = 0; i < jobs; i++) {
+    if (workers[i] > 0)
+      kill(workers[i], sig);
+  }
+}
+
+/* Start the workers, and look after them. */
+static void supervise(struct mapping *list)
+{
+  struct stats total;
+  sigset_t set;
+  int i, status;
+  pid_t pid;
 
-  if (listen(server, 1) < 0)
-    fatal("listening", errno);
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  signal(SIGCHLD, note);
+  signal(SIGTERM, note);
+  signal(SIGINT, note);
 
-  for (;;)
-    incoming();
+  workers = calloc(jobs, sizeof *workers);
+  if (workers == NULL)
+    fatal("allocating memory", errno);
+  for (i = 0; i < jobs; i++)
+    start_worker(i, list);
+
+  while (!stopping) {
+    sigsuspend(&waitmask);
+    if (reload) {
+      reload = 0;
+      stop_workers(SIGHUP);
+    }
+    if (report) {
+      report = 0;
+      memset(&total, 0, sizeof total);
+      for (i = 0; i < jobs; i++) {
+        total.sessions += all_stats[i].sessions;
+        total.connections += all_stats[i].connections;
+        total.refused += all_stats[i].refused;
+        total.to_chaos += all_stats[i].to_chaos;
+        total.from_chaos += all_stats[i].from_chaos;
+      }
+      print_stats("Gateway", &total);
+    }
+    exited = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (i = 0; i < jobs && workers[i] != pid; i++)
+        ;
+      if (i == jobs)
+        continue;
+      workers[i] = -1;
+      if (WIFEXITED(status)) {
+        /* It couldn't start, and the others won't do better. */
+        fprintf(stderr, "Worker %d exited\n", (int)pid);
+        stop_workers(SIGTERM);
+        exit(1);
+      }
+      fprintf(stderr, "Worker %d killed by signal %d\n", (int)pid,
+              WTERMSIG(status));
+      if (stopping)
+        break;
+      sleep(1);
+      start_worker(i, list);
+    }
+  }
+
+  stop_workers(SIGTERM);
+  exit(0);
 }
 
 static int usage(int code)
 {
   FILE *f = code ? stderr : stdout;
-  fprintf(f, "Usage: %s [-h] <port> <contact> <host>\n", argv0);
+  fprintf(f, "Usage: %s [-h] [options] <port> <contact> <host>[,<host>...]\n"
+          "       %s [-h] [options] -f <file>\n", argv0, argv0);
+  fprintf(f, "  -b N  Buffer size for each direction, default %d.\n",
+          BUFFER_SIZE);
+  fprintf(f, "  -c N  Microseconds to hold bulk data to fill packets.\n");
+  fprintf(f, "  -d N  Seconds to wait for the client to send, default 0.\n");
+  fprintf(f, "  -f F  Read ports from a file, again on SIGHUP.\n");
+  fprintf(f, "  -j N  Start N worker processes.\n");
+  fprintf(f, "  -p    Pin each worker to a CPU.\n");
+  fprintf(f, "  -P P  Profile: interactive (default), bulk, or auto.\n");
+  fprintf(f, "  -q N  Length of the accept queue, default %d.\n", SOMAXCONN);
+  fprintf(f, "  -r N  New connections allowed per second.\n");
+  fprintf(f, "  -R N  New connections per second from one address.\n");
+  fprintf(f, "  -s N  Sessions allowed at once.\n");
+  fprintf(f, "  -S N  Sessions at once from one address.\n");
+  fprintf(f, "  -t N  Seconds for a host to answer, default %d, 0 for"
+          " no limit.\n", CONNECT_TIMEOUT);
   exit(code);
 }
 
+static int number(const char *arg, int min)
+{
+  char *end;
+  long x = strtol(arg, &end, 10);
+  if (*arg == 0 || *end != 0 || x < min || x > INT_MAX) {
+    fprintf(stderr, "Bad number %s\n", arg);
+    usage(1);
+  }
+  return x;
+}
+
 int main(int argc, char **argv)
 {
+  struct mapping *list;
+  struct sigaction sa;
+  sigset_t set;
   int c;
 
   argv0 = argv[0];
 
-  while((c = getopt(argc, argv, "h")) != -1) {
+  while((c = getopt(argc, argv, "b:c:d:f:hj:pP:q:r:R:s:S:t:")) != -1) {
     switch(c) {
+    case 'b':
+      if (atol(optarg) < 1024) {
+        fprintf(stderr, "Bad buffer size %s\n", optarg);
+        usage(1);
+      }
+      buffer_size = atol(optarg);
+      break;
+    case 'c':
+      coalesce = number(optarg, 0);
+      break;
+    case 'd':
+      defer = number(optarg, 0);
+      break;
+    case 'f':
+      config = optarg;
+      break;
+    case 'j':
+      jobs = number(optarg, 1);
+      break;
+    case 'p':
+      pin = 1;
+      break;
+    case 'P':
+      profile = find_profile(optarg);
+      if (profile < 0) {
+        fprintf(stderr, "Bad profile %s\n", optarg);
+        usage(1);
+      }
+      break;
+    case 'q':
+      backlog = number(optarg, 1);
+      break;
+    case 'r':
+      max_rate = number(optarg, 1);
+      break;
+    case 'R':
+      max_source_rate = number(optarg, 1);
+      break;
+    case 's':
+      max_sessions = number(optarg, 1);
+      break;
+    case 'S':
+      max_source_sessions = number(optarg, 1);
+      break;
+    case 't':
+      timeout = number(optarg, 0);
+      break;
     case 'h':
       usage(0);
       break;
@@ -172,14 +2278,55 @@ int main(int argc, char **argv)
     }
   }
 
-  if (argc - optind != 3)
-    usage(1);
+  if (config != NULL) {
+    if (argc != optind)
+      usage(1);
+    list = read_config(config);
+    if (list == NULL)
+      exit(1);
+  } else {
+    if (argc - optind != 3)
+      usage(1);
+    list = new_mapping(NULL, argv[optind], argv[optind + 1],
+                       argv[optind + 2]);
+    if (list == NULL)
+      fatal("allocating memory", errno);
+    if (list->nhosts < 0) {
+      fprintf(stderr, "More than %d hosts\n", CHAOS_MAX_HOSTS);
+      exit(1);
+    }
+    if (list->nhosts == 0)
+      usage(1);
+  }
 
-  port = argv[optind];
-  contact = argv[optind + 1];
-  host = argv[optind + 2];
+  /* -s counts the sessions of all workers, and -r is split among
+     them.  The other limits are for each worker, since the kernel may
+     hand connections from one address to any of them. */
+  max_rate /= jobs;
+  all_stats = mmap(NULL, jobs * sizeof *all_stats, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (all_stats == MAP_FAILED)
+    fatal("allocating memory", errno);
+  stats = all_stats;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = note;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (config != NULL) {
+    sigaction(SIGHUP, &sa, NULL);
+    sigaddset(&set, SIGHUP);
+  }
+  sigprocmask(SIG_BLOCK, &set, &waitmask);
 
-  serve();
+  /* A client that goes away shouldn't take the gateway with it. */
+  signal(SIGPIPE, SIG_IGN);
+  raise_file_limit();
+  if (jobs > 1)
+    supervise(list);
+  serve(list);
 
   return 0;
 }
@@ -38,7 +38,8 @@ enable() {
 install_gw() {
     install -d "$BIN"
     install -m 755 gw "$BIN"
-    config gateway.sh "$BIN" "GW" "$BIN/gw"
+    config gateway.sh "$BIN" "GW" "$BIN/gw" "CONF" "$BIN/gateway.conf"
+    test -e "$BIN/gateway.conf" || install -m 644 gateway.conf "$BIN"
     test -d "$SYSTEMD" || return
     config chaosnet-gateway.service "$SYSTEMD" "WorkingDirectory" "$BIN"
     enable chaosnet-gateway
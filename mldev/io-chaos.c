@@ -18,13 +18,17 @@ static void fatal(const char *message, int error)
 
 void io_init (const char *host, const char *port)
 {
-  fd = chaos_stream();
+  const char *hosts[CHAOS_MAX_HOSTS + 1];
+  char *list = strdup(host);
+  int i;
+
+  chaos_host_list(list, hosts, CHAOS_MAX_HOSTS + 1);
+  fd = chaos_stream_rfc_any(hosts, port, NULL, 0, -1,
+                            CHAOS_RFC_STAGGER, &i);
   if (fd < 0)
-    fatal ("creating Chaosnet stream\n", errno);
-  if (chaos_stream_rfc(fd, host, port) < 0)
     fatal("during request for connection", errno);
   fprintf(stderr, "Opened connection to Chaosnet host %s, contact %s\n",
-          host, port);
+          hosts[i], port);
 }
 
 void io_flush (void)
@@ -5,6 +5,7 @@
 
 #include "io.h"
 #include "protoc.h"
+#include "../chaos-probe.h"
 
 static word_t ascii_to_sixbit (char *ascii)
 {
@@ -71,6 +72,8 @@ static int request (int cmd, int n, word_t *args, word_t *reply)
   file_eof = 0;
   file_error = 0;
 
+  /* There's only one MLDEV connection, so the probes leave it out. */
+  CHAOS_PROBE2 (request__start, cmd, n);
   aobjn = (-n << 18) + cmd;
   send_words (aobjn, args[0]);
   for (i = 1; i < n; i += 2)
@@ -78,7 +81,10 @@ static int request (int cmd, int n, word_t *args, word_t *reply)
   io_flush ();
 
   if (reply == NULL)
-    return 0;
+    {
+      CHAOS_PROBE3 (request__done, cmd, 0, 0);
+      return 0;
+    }
 
  again:
   recv_words (&aobjn, &reply[0]);
@@ -142,6 +148,7 @@ static int request (int cmd, int n, word_t *args, word_t *reply)
       exit (1);
     }
 
+  CHAOS_PROBE3 (request__done, cmd, (int)(aobjn & 0777777LL), n);
   return n;
 }
 
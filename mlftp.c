@@ -96,7 +96,7 @@ static int transfer_write(FILE *f)
 
 static void usage(char *x)
 {
-  fprintf(stderr, "Usage: %s -r|-w [-W<word format>] <host> <ITS file> <local file>\n\n", x);
+  fprintf(stderr, "Usage: %s -r|-w [-W<word format>] <host>[,<host>...] <ITS file> <local file>\n\n", x);
   usage_word_format();
   exit(1);
 }
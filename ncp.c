@@ -0,0 +1,1244 @@
+/* In-process Chaosnet NCP.
+
+   Clients talk to it over sockets using the same protocols as the
+   cbridge NCP: a stream socket starts with an RFC or LSN line and
+   then carries raw data, and a packet socket carries framed packets.
+   Towards the network, it keeps track of packet numbers, windows,
+   acknowledgements and retransmission for each connection.  A packet
+   client is told the far end's window by an STS once the connection
+   is open, and again whenever it changes.
+
+   RFC lines take an octal host address; chaos_stream_rfc and the
+   other library calls translate names before sending them.  When a
+   stream client shuts down its output, EOF is sent, and data keeps
+   coming back until the far end sends EOF or closes.
+
+   A stream client can also send a BRD line, "BRD subnets contact
+   args", where subnets is a comma-separated list of octal subnet
+   numbers or "all".  Every ANS that comes back is passed on as an
+   "ANS address length" line and the data, until the client closes.
+   The NCP answers STATUS itself when no one listens to it.
+
+   Packets on the network have the usual 16-byte header and a trailer
+   with destination, source and checksum.  All 16-bit words in header,
+   trailer, and the receipt and window words of STS and OPN, are in
+   network byte order. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "chaos.h"
+#include "ncp.h"
+
+#define DEFAULT_WINDOW 15
+#define RETRANSMIT     500    /* Milliseconds before resending a packet. */
+#define GIVE_UP        30000  /* Milliseconds without reply before LOS. */
+#define TICK           100    /* Milliseconds between timer runs. */
+#define CLIENT_BUFFER  16384
+
+enum { FREE, LISTEN, RFC_SENT, RFC_RCVD, OPEN, CLOSED, BRD_SENT };
+
+struct chpkt {
+  int opcode;
+  unsigned dest, dest_index, src, src_index, pkn, ack;
+  size_t nbytes;
+  unsigned char data[CHAOS_MAX_DATA + 1];
+};
+
+struct queued {
+  struct queued *next;
+  long long sent;
+  struct chpkt pkt;
+};
+
+struct conn {
+  int state;
+  int fd;
+  int packet;           /* Client uses the packet protocol. */
+  int raw;              /* Stream client past the RFC or LSN line. */
+  int serve;            /* Accept an RFC without asking the client. */
+  unsigned index;
+  unsigned local, remote, remote_index;
+  char contact[100];
+  unsigned pkn_sent, pkn_acked, pkn_read, ack_sent;
+  int local_window, remote_window;
+  int window_told;      /* Packet client knows remote_window. */
+  struct queued *queue, **tail;
+  struct queued *early; /* Received out of order. */
+  long long heard;      /* Last time anything came from the far end. */
+  int blocked;          /* Client input waits for the window. */
+  int hangup;           /* Client closed with input left to send. */
+  int eof;              /* Client closed its output; EOF sent. */
+  int ack_request;      /* Client asked for an ACK. */
+  int shut;             /* Shut down client output when written. */
+  size_t in_len;
+  unsigned char in[4 + MAX_PACKET + 16];
+  size_t out_len;
+  unsigned char out[CLIENT_BUFFER];
+};
+
+struct ncp {
+  unsigned address;
+  int any_address;
+  ncp_contact_t *contact_hook;
+  ncp_transmit_t *transmit;
+  void *arg;
+  unsigned generation;
+  int window;
+  int exiting;
+  long long tick;
+  struct conn *conn[NCP_MAX_CONN];
+  unsigned poll_index[NCP_MAX_CONN];
+};
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put16(unsigned char *p, unsigned x)
+{
+  p[0] = (x >> 8) & 0xFF;
+  p[1] = x & 0xFF;
+}
+
+static unsigned get16(const unsigned char *p)
+{
+  return ((unsigned)p[0] << 8) | p[1];
+}
+
+static unsigned checksum(const unsigned char *p, size_t n)
+{
+  unsigned long sum = 0;
+  size_t i;
+  for (i = 0; i + 1 < n; i += 2)
+    sum += get16(p + i);
+  while (sum > 0xFFFF)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum & 0xFFFF;
+}
+
+static size_t encode(const struct chpkt *p, unsigned char *wire)
+{
+  size_t n = CHAOS_HEADER + p->nbytes;
+
+  wire[0] = p->opcode;
+  wire[1] = 0;
+  put16(wire + 2, p->nbytes & 07777);
+  put16(wire + 4, p->dest);
+  put16(wire + 6, p->dest_index);
+  put16(wire + 8, p->src);
+  put16(wire + 10, p->src_index);
+  put16(wire + 12, p->pkn);
+  put16(wire + 14, p->ack);
+  memcpy(wire + CHAOS_HEADER, p->data, p->nbytes);
+  if (n & 1)
+    wire[n++] = 0;
+  put16(wire + n, p->dest);
+  put16(wire + n + 2, p->src);
+  put16(wire + n + 4, checksum(wire, n + 4));
+  return n + CHAOS_TRAILER;
+}
+
+static int decode(const unsigned char *wire, size_t len, struct chpkt *p)
+{
+  size_t n;
+
+  if (len < CHAOS_HEADER + CHAOS_TRAILER)
+    return -1;
+  p->opcode = wire[0];
+  p->nbytes = get16(wire + 2) & 07777;
+  n = CHAOS_HEADER + p->nbytes + (p->nbytes & 1);
+  if (p->nbytes > CHAOS_MAX_DATA || n + CHAOS_TRAILER > len)
+    return -1;
+  if (get16(wire + n + 4) != 0 &&
+      checksum(wire, n + 4) != get16(wire + n + 4))
+    return -1;
+  p->dest = get16(wire + 4);
+  p->dest_index = get16(wire + 6);
+  p->src = get16(wire + 8);
+  p->src_index = get16(wire + 10);
+  p->pkn = get16(wire + 12);
+  p->ack = get16(wire + 14);
+  memcpy(p->data, wire + CHAOS_HEADER, p->nbytes);
+  return 0;
+}
+
+int chaos_packet_decode(const unsigned char *wire, size_t len, int *opcode,
+                        unsigned *dest, unsigned *src,
+                        const unsigned char **data, size_t *n)
+{
+  size_t m;
+  if (len < CHAOS_HEADER)
+    return -1;
+  m = get16(wire + 2) & 07777;
+  if (CHAOS_HEADER + m > len)
+    return -1;
+  *opcode = wire[0];
+  *dest = get16(wire + 4);
+  *src = get16(wire + 8);
+  *data = wire + CHAOS_HEADER;
+  *n = m;
+  return 0;
+}
+
+/* Packet number a comes before or is equal to b. */
+static int pkn_le(unsigned a, unsigned b)
+{
+  return ((b - a) & 0xFFFF) < 0x8000;
+}
+
+struct ncp *ncp_new(unsigned address, ncp_transmit_t *transmit, void *arg)
+{
+  struct ncp *ncp = calloc(1, sizeof *ncp);
+  if (ncp == NULL)
+    return NULL;
+  ncp->address = address;
+  ncp->window = DEFAULT_WINDOW;
+  ncp->transmit = transmit;
+  ncp->arg = arg;
+  return ncp;
+}
+
+/* Window size for connections that don't ask for one. */
+void ncp_window(struct ncp *ncp, int window)
+{
+  ncp->window = window > MAX_WINDOW ? MAX_WINDOW : window;
+}
+
+/* Accept packets for any destination, as if this NCP was every host
+   on the network. */
+void ncp_any_address(struct ncp *ncp, ncp_contact_t *hook)
+{
+  ncp->any_address = 1;
+  ncp->contact_hook = hook;
+}
+
+static struct conn *conn_new(struct ncp *ncp, int fd, int packet)
+{
+  struct conn *c;
+  int i;
+
+  for (i = 1; i < NCP_MAX_CONN; i++) {
+    if (ncp->conn[i] == NULL)
+      break;
+  }
+  if (i == NCP_MAX_CONN) {
+    errno = EMFILE;
+    return NULL;
+  }
+  c = calloc(1, sizeof *c);
+  if (c == NULL)
+    return NULL;
+  ncp->generation++;
+  c->index = i | ((ncp->generation & 0xFF) << 8);
+  c->fd = fd;
+  c->packet = packet;
+  c->local = ncp->address;
+  c->local_window = ncp->window;
+  c->remote_window = DEFAULT_WINDOW;
+  c->tail = &c->queue;
+  c->heard = now_ms();
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  ncp->conn[i] = c;
+  return c;
+}
+
+static void conn_free(struct ncp *ncp, struct conn *c)
+{
+  struct queued *q;
+  while ((q = c->queue) != NULL) {
+    c->queue = q->next;
+    free(q);
+  }
+  while ((q = c->early) != NULL) {
+    c->early = q->next;
+    free(q);
+  }
+  if (c->fd >= 0)
+    close(c->fd);
+  ncp->conn[c->index & 0xFF] = NULL;
+  free(c);
+}
+
+/* Close all client sockets and forget the connections, without
+   telling the network. */
+void ncp_free(struct ncp *ncp)
+{
+  int i;
+  for (i = 0; i < NCP_MAX_CONN; i++) {
+    if (ncp->conn[i] != NULL)
+      conn_free(ncp, ncp->conn[i]);
+  }
+  free(ncp);
+}
+
+static struct conn *conn_find(struct ncp *ncp, unsigned index)
+{
+  struct conn *c = ncp->conn[index & 0xFF];
+  if (c == NULL || c->index != index)
+    return NULL;
+  return c;
+}
+
+int ncp_connections(struct ncp *ncp)
+{
+  int i, n = 0;
+  for (i = 0; i < NCP_MAX_CONN; i++) {
+    if (ncp->conn[i] != NULL)
+      n++;
+  }
+  return n;
+}
+
+/* Client side. */
+
+static int client_write(struct conn *c, const void *data, size_t n)
+{
+  if (c->out_len + n > sizeof c->out)
+    return -1;
+  memcpy(c->out + c->out_len, data, n);
+  c->out_len += n;
+  return 0;
+}
+
+static int client_packet(struct conn *c, int opcode,
+                         const void *data, size_t n)
+{
+  unsigned char header[4];
+  if (c->out_len + sizeof header + n > sizeof c->out)
+    return -1;
+  header[0] = opcode;
+  header[1] = 0;
+  header[2] = n & 0xFF;
+  header[3] = (n >> 8) & 0xFF;
+  client_write(c, header, sizeof header);
+  client_write(c, data, n);
+  return 0;
+}
+
+static void client_line(struct conn *c, const char *format, ...)
+{
+  char line[MAX_PACKET + 16];
+  va_list ap;
+  int n;
+
+  va_start(ap, format);
+  n = vsnprintf(line, sizeof line - 2, format, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if ((size_t)n > sizeof line - 3)
+    n = sizeof line - 3;
+  memcpy(line + n, "\r\n", 2);
+  client_write(c, line, n + 2);
+}
+
+/* Tell the client the connection is gone, and close it once the
+   output is written. */
+static void client_close(struct conn *c, int opcode,
+                         const void *reason, size_t n)
+{
+  if (c->packet)
+    client_packet(c, opcode, reason, n);
+  else if (!c->raw || c->state == RFC_SENT)
+    client_line(c, "%s %.*s", opcode == CHOP_LOS ? "LOS" : "CLS",
+                (int)n, (const char *)reason);
+  c->state = CLOSED;
+}
+
+/* Network side. */
+
+static void transmit(struct ncp *ncp, struct conn *c, struct chpkt *p)
+{
+  unsigned char wire[CHAOS_MAX_WIRE];
+  p->ack = c->pkn_read;
+  c->ack_sent = c->pkn_read;
+  ncp->transmit(ncp->arg, p->dest, wire, encode(p, wire));
+}
+
+static void make(struct conn *c, struct chpkt *p, int opcode,
+                 const void *data, size_t n)
+{
+  p->opcode = opcode;
+  p->dest = c->remote;
+  p->dest_index = c->remote_index;
+  p->src = c->local;
+  p->src_index = c->index;
+  p->pkn = c->pkn_sent;
+  if (n > CHAOS_MAX_DATA)
+    n = CHAOS_MAX_DATA;
+  p->nbytes = n;
+  memcpy(p->data, data, n);
+}
+
+static void send_control(struct ncp *ncp, struct conn *c, int opcode,
+                         const void *data, size_t n)
+{
+  struct chpkt p;
+  make(c, &p, opcode, data, n);
+  transmit(ncp, c, &p);
+}
+
+static void send_sequenced(struct ncp *ncp, struct conn *c, int opcode,
+                           const void *data, size_t n)
+{
+  struct queued *q = malloc(sizeof *q);
+  if (q == NULL)
+    return;
+  c->pkn_sent = (c->pkn_sent + 1) & 0xFFFF;
+  make(c, &q->pkt, opcode, data, n);
+  q->next = NULL;
+  q->sent = now_ms();
+  *c->tail = q;
+  c->tail = &q->next;
+  transmit(ncp, c, &q->pkt);
+}
+
+static void window_words(struct conn *c, unsigned char *data)
+{
+  put16(data, c->pkn_read);
+  put16(data + 2, c->local_window);
+}
+
+static void send_sts(struct ncp *ncp, struct conn *c)
+{
+  unsigned char data[4];
+  window_words(c, data);
+  send_control(ncp, c, CHOP_STS, data, sizeof data);
+}
+
+/* Reply to a packet which doesn't belong to any connection. */
+static void reply_data(struct ncp *ncp, const struct chpkt *p, int opcode,
+                       const void *data, size_t n)
+{
+  unsigned char wire[CHAOS_MAX_WIRE];
+  struct chpkt r;
+
+  memset(&r, 0, sizeof r);
+  r.opcode = opcode;
+  r.dest = p->src;
+  r.dest_index = p->src_index;
+  r.src = p->dest;
+  r.nbytes = n;
+  memcpy(r.data, data, n);
+  ncp->transmit(ncp->arg, r.dest, wire, encode(&r, wire));
+}
+
+static void reply(struct ncp *ncp, const struct chpkt *p, int opcode,
+                  const char *reason)
+{
+  reply_data(ncp, p, opcode, reason, strlen(reason));
+}
+
+static int outstanding(const struct conn *c)
+{
+  return (c->pkn_sent - c->pkn_acked) & 0xFFFF;
+}
+
+static void client_input(struct ncp *ncp, struct conn *c);
+
+/* Close a connection both ends have sent EOF on, once ours is
+   acknowledged.  The client's socket stays open until then, for what
+   the far end sends back. */
+static void finish(struct ncp *ncp, struct conn *c)
+{
+  if (c->eof && c->queue == NULL && c->state == OPEN
+      && (c->shut || ncp->exiting)) {
+    send_control(ncp, c, CHOP_CLS, NULL, 0);
+    c->state = CLOSED;
+  }
+}
+
+static void acknowledge(struct ncp *ncp, struct conn *c, unsigned ack)
+{
+  struct queued *q;
+
+  if (c->state != OPEN && c->state != RFC_SENT && c->state != RFC_RCVD)
+    return;
+  if (!pkn_le(ack, c->pkn_sent))
+    return;
+  while ((q = c->queue) != NULL && pkn_le(q->pkt.pkn, ack)) {
+    c->queue = q->next;
+    free(q);
+  }
+  if (c->queue == NULL)
+    c->tail = &c->queue;
+  if (pkn_le(c->pkn_acked, ack))
+    c->pkn_acked = ack;
+
+  if (c->queue != NULL)
+    return;
+  if (c->ack_request && c->state == OPEN) {
+    c->ack_request = 0;
+    client_packet(c, CHOP_ACK, NULL, 0);
+  }
+  finish(ncp, c);
+}
+
+/* Parse "[winsize=N] rest" options. */
+static const char *options(struct conn *c, const char *p)
+{
+  const char *end;
+  int n;
+
+  while (*p == ' ')
+    p++;
+  if (*p != '[')
+    return p;
+  end = strchr(p, ']');
+  if (end == NULL)
+    return p;
+  if (sscanf(p, "[winsize=%d", &n) == 1 && n > 0)
+    c->local_window = n > MAX_WINDOW ? MAX_WINDOW : n;
+  for (p = end + 1; *p == ' '; p++)
+    ;
+  return p;
+}
+
+/* The host in an RFC line.  Names are translated by the client
+   library before the line is sent; looking one up here could wait
+   for a HOSTAB server, or even need this NCP to reach it. */
+static int resolve(const char *host)
+{
+  const char *p;
+  for (p = host; *p; p++) {
+    if (*p < '0' || *p > '7')
+      return -1;
+  }
+  return *host ? (int)strtol(host, NULL, 8) : -1;
+}
+
+static void command_rfc(struct ncp *ncp, struct conn *c, char *text)
+{
+  char *host, *rest;
+  int address;
+
+  rest = (char *)options(c, text);
+  host = rest;
+  rest = strchr(rest, ' ');
+  if (rest == NULL) {
+    client_close(c, CHOP_CLS, "Bad RFC", 7);
+    return;
+  }
+  *rest++ = 0;
+  address = resolve(host);
+  if (address <= 0) {
+    client_close(c, CHOP_CLS, "Unknown host", 12);
+    return;
+  }
+  c->remote = address;
+  c->state = RFC_SENT;
+  c->heard = now_ms();
+  send_sequenced(ncp, c, CHOP_RFC, rest, strlen(rest));
+}
+
+/* Send a BRD to a list of subnets.  The subnet mask goes first in
+   the data, with its length in the acknowledgement field. */
+static void command_brd(struct ncp *ncp, struct conn *c, char *text)
+{
+  unsigned char wire[CHAOS_MAX_WIRE];
+  unsigned char mask[32];
+  struct chpkt p;
+  char *subnets, *rest, *end;
+  size_t n = 0;
+  long subnet;
+
+  subnets = (char *)options(c, text);
+  rest = strchr(subnets, ' ');
+  if (rest == NULL) {
+    client_close(c, CHOP_CLS, "Bad BRD", 7);
+    return;
+  }
+  *rest++ = 0;
+
+  memset(mask, 0, sizeof mask);
+  if (strcasecmp(subnets, "all") == 0) {
+    memset(mask, 0xFF, sizeof mask);
+    n = sizeof mask;
+  } else {
+    for (;;) {
+      subnet = strtol(subnets, &end, 8);
+      if (end == subnets || subnet < 0 || subnet >= 8 * (long)sizeof mask) {
+        client_close(c, CHOP_CLS, "Bad subnet", 10);
+        return;
+      }
+      mask[subnet / 8] |= 1 << (subnet % 8);
+      if ((size_t)subnet / 8 + 1 > n)
+        n = subnet / 8 + 1;
+      if (*end != ',')
+        break;
+      subnets = end + 1;
+    }
+  }
+  n = (n + 3) & ~3;
+  if (n + strlen(rest) > CHAOS_MAX_DATA) {
+    client_close(c, CHOP_CLS, "BRD too long", 12);
+    return;
+  }
+
+  c->remote = 0;
+  c->state = BRD_SENT;
+  make(c, &p, CHOP_BRD, mask, n);
+  memcpy(p.data + n, rest, strlen(rest));
+  p.nbytes = n + strlen(rest);
+  p.ack = n;
+  ncp->transmit(ncp->arg, 0, wire, encode(&p, wire));
+}
+
+static void command_lsn(struct conn *c, char *text)
+{
+  const char *contact = options(c, text);
+  strncpy(c->contact, contact, sizeof c->contact - 1);
+  c->state = LISTEN;
+}
+
+static void command_opn(struct ncp *ncp, struct conn *c)
+{
+  unsigned char data[4];
+  if (c->state != RFC_RCVD)
+    return;
+  c->state = OPEN;
+  window_words(c, data);
+  send_sequenced(ncp, c, CHOP_OPN, data, sizeof data);
+}
+
+static void command_cls(struct ncp *ncp, struct conn *c,
+                        const void *reason, size_t n)
+{
+  if (c->state == OPEN || c->state == RFC_RCVD || c->state == RFC_SENT)
+    send_control(ncp, c, CHOP_CLS, reason, n);
+  c->state = CLOSED;
+}
+
+/* A packet from a packet client.  Returns zero if it has to wait for
+   the window. */
+static int client_packet_in(struct ncp *ncp, struct conn *c, int opcode,
+                            unsigned char *data, size_t n)
+{
+  char text[MAX_PACKET + 1];
+
+  if (opcode >= CHOP_DAT || opcode == CHOP_EOF) {
+    if (c->state != OPEN)
+      return 1;
+    if (outstanding(c) >= c->remote_window)
+      return 0;
+    send_sequenced(ncp, c, opcode, data, n);
+    return 1;
+  }
+
+  memcpy(text, data, n);
+  text[n] = 0;
+  switch (opcode) {
+  case CHOP_RFC:
+    if (c->state == FREE)
+      command_rfc(ncp, c, text);
+    break;
+  case CHOP_LSN:
+    if (c->state == FREE)
+      command_lsn(c, text);
+    break;
+  case CHOP_OPN:
+    command_opn(ncp, c);
+    break;
+  case CHOP_CLS:
+    command_cls(ncp, c, data, n);
+    break;
+  case CHOP_ANS:
+    if (c->state == RFC_RCVD) {
+      send_control(ncp, c, CHOP_ANS, data, n);
+      c->state = CLOSED;
+    }
+    break;
+  case CHOP_ACK:
+    if (c->queue == NULL)
+      client_packet(c, CHOP_ACK, NULL, 0);
+    else
+      c->ack_request = 1;
+    break;
+  }
+  return 1;
+}
+
+/* A control line from a stream client. */
+static void client_line_in(struct ncp *ncp, struct conn *c, char *line)
+{
+  if (strncasecmp(line, "RFC ", 4) == 0 && c->state == FREE) {
+    command_rfc(ncp, c, line + 4);
+    if (c->state == RFC_SENT)
+      c->raw = 1;
+  } else if (strncasecmp(line, "LSN ", 4) == 0 && c->state == FREE)
+    command_lsn(c, line + 4);
+  else if (strncasecmp(line, "BRD ", 4) == 0 && c->state == FREE)
+    command_brd(ncp, c, line + 4);
+  else if (strncasecmp(line, "OPN", 3) == 0 && c->state == RFC_RCVD) {
+    command_opn(ncp, c);
+    c->raw = 1;
+  } else if (strncasecmp(line, "CLS", 3) == 0) {
+    line += 3;
+    while (*line == ' ')
+      line++;
+    command_cls(ncp, c, line, strlen(line));
+  } else
+    client_close(c, CHOP_CLS, "Bad command", 11);
+}
+
+/* Process what the client has written, as far as the window
+   allows. */
+static void client_input(struct ncp *ncp, struct conn *c)
+{
+  unsigned char *p = c->in;
+  size_t n, m = c->in_len;
+  char *end;
+
+  c->blocked = 0;
+  while (m > 0 && c->state != CLOSED) {
+    if (c->packet) {
+      if (m < 4)
+        break;
+      n = p[2] | (p[3] << 8);
+      if (n > MAX_PACKET) {
+        client_close(c, CHOP_LOS, "Packet too long", 15);
+        break;
+      }
+      if (m < 4 + n)
+        break;
+      if (!client_packet_in(ncp, c, p[0], p + 4, n)) {
+        c->blocked = 1;
+        break;
+      }
+      n += 4;
+    } else if (!c->raw || c->state == RFC_SENT) {
+      if (c->raw)
+        break;
+      end = memchr(p, '\n', m);
+      if (end == NULL) {
+        if (m == sizeof c->in)
+          client_close(c, CHOP_LOS, "Line too long", 13);
+        break;
+      }
+      *end = 0;
+      n = end - (char *)p + 1;
+      if (end > (char *)p && end[-1] == '\r')
+        end[-1] = 0;
+      client_line_in(ncp, c, (char *)p);
+    } else {
+      if (c->state != OPEN)
+        break;
+      if (outstanding(c) >= c->remote_window) {
+        c->blocked = 1;
+        break;
+      }
+      n = m < CHAOS_MAX_DATA ? m : CHAOS_MAX_DATA;
+      send_sequenced(ncp, c, CHOP_DAT, p, n);
+    }
+    p += n;
+    m -= n;
+  }
+
+  memmove(c->in, p, m);
+  c->in_len = m;
+
+  if (c->hangup && m == 0 && c->state == OPEN) {
+    c->hangup = 0;
+    c->eof = 1;
+    send_sequenced(ncp, c, CHOP_EOF, NULL, 0);
+  }
+}
+
+static void client_read(struct ncp *ncp, struct conn *c)
+{
+  ssize_t n;
+
+  n = read(c->fd, c->in + c->in_len, sizeof c->in - c->in_len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    if (!ncp->exiting)
+      return;
+    n = 0;
+  }
+  if (n <= 0) {
+    /* The client is gone.  A stream connection is closed gracefully
+       after all data is acknowledged. */
+    if (c->state == OPEN && !c->packet) {
+      c->hangup = 1;
+      client_input(ncp, c);
+    } else {
+      command_cls(ncp, c, NULL, 0);
+      c->out_len = 0;
+    }
+    return;
+  }
+
+  c->in_len += n;
+  client_input(ncp, c);
+}
+
+static void client_flush(struct ncp *ncp, struct conn *c)
+{
+  ssize_t n;
+
+  if (c->fd < 0) {
+    c->out_len = 0;
+    return;
+  }
+  while (c->out_len > 0) {
+    /* The client may have closed the socket altogether. */
+    n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    if (n <= 0) {
+      command_cls(ncp, c, NULL, 0);
+      c->out_len = 0;
+      return;
+    }
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+  }
+  if (c->shut == 1) {
+    shutdown(c->fd, SHUT_WR);
+    c->shut = 2;
+  }
+}
+
+/* Add a client socket.  packet is nonzero for the packet protocol. */
+int ncp_client(struct ncp *ncp, int fd, int packet)
+{
+  return conn_new(ncp, fd, packet) == NULL ? -1 : 0;
+}
+
+static struct conn *listener(struct ncp *ncp, int fd, int packet,
+                             const char *contact)
+{
+  struct conn *c = conn_new(ncp, fd, packet);
+  if (c == NULL)
+    return NULL;
+  strncpy(c->contact, contact, sizeof c->contact - 1);
+  c->state = LISTEN;
+  return c;
+}
+
+/* Add a client that is already listening to a contact. */
+int ncp_listen(struct ncp *ncp, int fd, int packet, const char *contact)
+{
+  return listener(ncp, fd, packet, contact) == NULL ? -1 : 0;
+}
+
+/* Add a stream client that serves one connection to a contact.  The
+   RFC is accepted right away, so the client only sees the data. */
+int ncp_serve(struct ncp *ncp, int fd, const char *contact)
+{
+  struct conn *c = listener(ncp, fd, 0, contact);
+  if (c == NULL)
+    return -1;
+  c->serve = 1;
+  return 0;
+}
+
+/* Packets from the network. */
+
+static struct conn *find_listener(struct ncp *ncp, const char *contact)
+{
+  struct conn *c;
+  int i;
+  for (i = 0; i < NCP_MAX_CONN; i++) {
+    c = ncp->conn[i];
+    if (c != NULL && c->state == LISTEN && strcasecmp(c->contact, contact) == 0)
+      return c;
+  }
+  return NULL;
+}
+
+/* Answer STATUS with the host name.  There are no interface
+   counters to report. */
+static void answer_status(struct ncp *ncp, struct chpkt *p)
+{
+  char name[32];
+  memset(name, 0, sizeof name);
+  if (gethostname(name, sizeof name) < 0 || name[0] == 0)
+    snprintf(name, sizeof name, "%o", p->dest);
+  reply_data(ncp, p, CHOP_ANS, name, sizeof name);
+}
+
+static void receive_rfc(struct ncp *ncp, struct chpkt *p)
+{
+  char contact[100], *args;
+  struct conn *c;
+  size_t n;
+  int i;
+
+  for (i = 0; i < NCP_MAX_CONN; i++) {
+    c = ncp->conn[i];
+    if (c != NULL && c->state != LISTEN && c->remote == p->src
+        && c->remote_index == p->src_index)
+      return;
+  }
+
+  p->data[p->nbytes] = 0;
+  n = strcspn((char *)p->data, " ");
+  if (n >= sizeof contact)
+    n = sizeof contact - 1;
+  memcpy(contact, p->data, n);
+  contact[n] = 0;
+  args = (char *)p->data + n;
+  if (*args == ' ')
+    args++;
+
+  c = find_listener(ncp, contact);
+  if (c == NULL && ncp->contact_hook != NULL
+      && ncp->contact_hook(ncp->arg, ncp, p->dest, p->src, contact, args))
+    c = find_listener(ncp, contact);
+  if (c == NULL && strcasecmp(contact, "STATUS") == 0) {
+    answer_status(ncp, p);
+    return;
+  }
+  if (c == NULL) {
+    /* Only answer a BRD if there's something to say. */
+    if (p->opcode == CHOP_RFC)
+      reply(ncp, p, CHOP_CLS, "No server for this contact");
+    return;
+  }
+
+  c->state = RFC_RCVD;
+  c->local = p->dest;
+  c->remote = p->src;
+  c->remote_index = p->src_index;
+  c->pkn_read = c->ack_sent = p->pkn;
+  c->heard = now_ms();
+  if (c->serve) {
+    c->raw = 1;
+    command_opn(ncp, c);
+  } else if (c->packet) {
+    char text[MAX_PACKET];
+    int m = snprintf(text, sizeof text, "%o%s%s", p->src,
+                     *args ? " " : "", args);
+    client_packet(c, CHOP_RFC, text, m);
+  } else
+    client_line(c, "RFC %o%s%s", p->src, *args ? " " : "", args);
+}
+
+/* A BRD is an RFC to every host on the subnets in its mask. */
+static void receive_brd(struct ncp *ncp, struct chpkt *p)
+{
+  unsigned subnet = (ncp->address >> 8) & 0xFF;
+  size_t n = p->ack;
+
+  if (n > p->nbytes || n <= subnet / 8
+      || (p->data[subnet / 8] & (1 << (subnet % 8))) == 0)
+    return;
+  p->dest = ncp->address;
+  p->nbytes -= n;
+  memmove(p->data, p->data + n, p->nbytes);
+  receive_rfc(ncp, p);
+}
+
+static int deliver(struct conn *c, struct chpkt *p)
+{
+  if (c->packet)
+    return client_packet(c, p->opcode, p->data, p->nbytes) == 0;
+  if (p->opcode == CHOP_EOF) {
+    c->shut = 1;
+    return 1;
+  }
+  return client_write(c, p->data, p->nbytes) == 0;
+}
+
+/* Keep a packet that arrived ahead of one that was lost, in packet
+   number order. */
+static void hold(struct conn *c, struct chpkt *p)
+{
+  unsigned distance = (p->pkn - c->pkn_read) & 0xFFFF;
+  struct queued *q, **e;
+
+  if (distance > (unsigned)c->local_window)
+    return;
+  for (e = &c->early; *e != NULL; e = &(*e)->next) {
+    if ((*e)->pkt.pkn == p->pkn)
+      return;
+    if ((((*e)->pkt.pkn - c->pkn_read) & 0xFFFF) > distance)
+      break;
+  }
+  q = malloc(sizeof *q);
+  if (q == NULL)
+    return;
+  q->pkt = *p;
+  q->next = *e;
+  *e = q;
+}
+
+static void receive_data(struct ncp *ncp, struct conn *c, struct chpkt *p)
+{
+  struct queued *q;
+
+  if (c->state != OPEN)
+    return;
+  if (p->pkn != ((c->pkn_read + 1) & 0xFFFF)) {
+    /* Let the sender know where we are if it's a duplicate. */
+    if (pkn_le(p->pkn, c->pkn_read))
+      send_sts(ncp, c);
+    else
+      hold(c, p);
+    return;
+  }
+
+  if (!deliver(c, p))
+    return;   /* Client is slow; don't acknowledge. */
+  c->pkn_read = p->pkn;
+
+  while ((q = c->early) != NULL) {
+    if (q->pkt.pkn == ((c->pkn_read + 1) & 0xFFFF)) {
+      if (!deliver(c, &q->pkt))
+        break;
+      c->pkn_read = q->pkt.pkn;
+    } else if (!pkn_le(q->pkt.pkn, c->pkn_read))
+      break;
+    c->early = q->next;
+    free(q);
+  }
+
+  if (((c->pkn_read - c->ack_sent) & 0xFFFF) >= (unsigned)c->local_window / 2)
+    send_sts(ncp, c);
+  finish(ncp, c);
+}
+
+/* Receipt and window for a packet client, which takes them in its
+   own byte order.  The first one tells it the window size. */
+static void window_client(struct conn *c, unsigned char *data)
+{
+  data[0] = c->pkn_acked & 0xFF;
+  data[1] = c->pkn_acked >> 8;
+  data[2] = c->remote_window & 0xFF;
+  data[3] = c->remote_window >> 8;
+  c->window_told = 1;
+}
+
+void ncp_receive(struct ncp *ncp, const unsigned char *wire, size_t len)
+{
+  unsigned char data[4];
+  struct chpkt p;
+  struct conn *c;
+  int window;
+
+  if (decode(wire, len, &p) < 0)
+    return;
+  if (p.opcode == CHOP_BRD && p.dest == 0) {
+    receive_brd(ncp, &p);
+    return;
+  }
+  if (!ncp->any_address && p.dest != ncp->address)
+    return;
+
+  if (p.opcode == CHOP_RFC) {
+    receive_rfc(ncp, &p);
+    return;
+  }
+
+  c = conn_find(ncp, p.dest_index);
+  if (c != NULL && c->state == BRD_SENT) {
+    if (p.opcode == CHOP_ANS) {
+      client_line(c, "ANS %o %d", p.src, (int)p.nbytes);
+      client_write(c, p.data, p.nbytes);
+    }
+    return;
+  }
+  if (c == NULL || c->remote != p.src || c->state == CLOSED
+      || (c->state != RFC_SENT && c->remote_index != p.src_index)) {
+    if (p.opcode >= CHOP_DAT || p.opcode == CHOP_EOF)
+      reply(ncp, &p, CHOP_LOS, "Connection doesn't exist");
+    return;
+  }
+  c->heard = now_ms();
+
+  switch (p.opcode) {
+  case CHOP_OPN:
+    if (c->state == RFC_SENT) {
+      c->remote_index = p.src_index;
+      c->pkn_read = p.pkn;
+      if (p.nbytes >= 4)
+        c->remote_window = get16(p.data + 2);
+      c->state = OPEN;
+      acknowledge(ncp, c, p.ack);
+      if (c->packet) {
+        client_packet(c, CHOP_OPN, NULL, 0);
+        window_client(c, data);
+        client_packet(c, CHOP_STS, data, sizeof data);
+      } else
+        client_line(c, "OPN %o", c->remote);
+    }
+    send_sts(ncp, c);
+    break;
+  case CHOP_STS:
+    acknowledge(ncp, c, p.ack);
+    if (p.nbytes >= 4) {
+      acknowledge(ncp, c, get16(p.data));
+      window = get16(p.data + 2);
+      if (window != c->remote_window)
+        c->window_told = 0;
+      c->remote_window = window;
+      if (!c->window_told && c->packet && c->state == OPEN) {
+        window_client(c, data);
+        client_packet(c, CHOP_STS, data, sizeof data);
+      }
+    }
+    break;
+  case CHOP_SNS:
+    acknowledge(ncp, c, p.ack);
+    send_sts(ncp, c);
+    break;
+  case CHOP_CLS:
+  case CHOP_LOS:
+    client_close(c, p.opcode, p.data, p.nbytes);
+    break;
+  case CHOP_ANS:
+    if (c->state == RFC_SENT) {
+      if (c->packet)
+        client_packet(c, CHOP_ANS, p.data, p.nbytes);
+      else {
+        client_line(c, "ANS %o %d", p.src, (int)p.nbytes);
+        client_write(c, p.data, p.nbytes);
+      }
+      c->state = CLOSED;
+    }
+    break;
+  default:
+    if (p.opcode >= CHOP_DAT || p.opcode == CHOP_EOF) {
+      acknowledge(ncp, c, p.ack);
+      receive_data(ncp, c, &p);
+    }
+    break;
+  }
+
+  if (c->blocked)
+    client_input(ncp, c);
+}
+
+/* Event loop glue. */
+
+static int wants_input(const struct conn *c)
+{
+  if (c->fd < 0 || c->state == CLOSED || c->blocked || c->hangup
+      || c->eof)
+    return 0;
+  return c->in_len < sizeof c->in;
+}
+
+int ncp_pollfds(struct ncp *ncp, struct pollfd *pfd, int max)
+{
+  struct conn *c;
+  int i, n = 0;
+
+  for (i = 0; i < NCP_MAX_CONN && n < max; i++) {
+    c = ncp->conn[i];
+    if (c == NULL || c->fd < 0)
+      continue;
+    pfd[n].events = (wants_input(c) ? POLLIN : 0)
+      | (c->out_len > 0 || c->shut == 1 ? POLLOUT : 0);
+    /* A client that hung up would be reported over and over while
+       there's no room to read the rest of what it sent. */
+    if (pfd[n].events == 0)
+      continue;
+    pfd[n].fd = c->fd;
+    pfd[n].revents = 0;
+    ncp->poll_index[n] = c->index;
+    n++;
+  }
+  return n;
+}
+
+static void reap(struct ncp *ncp, struct conn *c)
+{
+  if (c->state == CLOSED && c->out_len == 0)
+    conn_free(ncp, c);
+  else if (c->fd < 0 && c->queue == NULL && c->state != OPEN)
+    conn_free(ncp, c);
+}
+
+void ncp_events(struct ncp *ncp, const struct pollfd *pfd, int n)
+{
+  struct conn *c;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    c = conn_find(ncp, ncp->poll_index[i]);
+    if (c == NULL || c->fd != pfd[i].fd)
+      continue;
+    if ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) && wants_input(c))
+      client_read(ncp, c);
+    if (ncp->exiting && wants_input(c))
+      client_read(ncp, c);
+    if (c->out_len > 0 || c->shut == 1)
+      client_flush(ncp, c);
+    reap(ncp, c);
+  }
+}
+
+/* The process is about to exit.  Treat every client as gone once
+   it has nothing more to read, and let the connections close. */
+void ncp_shutdown(struct ncp *ncp)
+{
+  ncp->exiting = 1;
+}
+
+int ncp_timeout(struct ncp *ncp)
+{
+  int i;
+  if (ncp->exiting)
+    return TICK;
+  for (i = 0; i < NCP_MAX_CONN; i++) {
+    if (ncp->conn[i] != NULL && ncp->conn[i]->state != LISTEN)
+      return TICK;
+  }
+  return -1;
+}
+
+void ncp_timers(struct ncp *ncp)
+{
+  long long now = now_ms();
+  struct queued *q;
+  struct conn *c;
+  int i, tick;
+
+  /* Acknowledgements are delayed until the next tick, unless half
+     the window is used up. */
+  tick = now - ncp->tick >= TICK;
+  if (tick)
+    ncp->tick = now;
+
+  for (i = 0; i < NCP_MAX_CONN; i++) {
+    c = ncp->conn[i];
+    if (c == NULL)
+      continue;
+    if (!tick)
+      ;
+    else if (c->queue != NULL && now - c->heard > GIVE_UP) {
+      client_close(c, CHOP_LOS, "Host not responding", 19);
+      if (c->fd < 0)
+        c->out_len = 0;
+    } else if (c->state == OPEN || c->state == RFC_SENT
+               || c->state == RFC_RCVD) {
+      for (q = c->queue; q != NULL; q = q->next) {
+        if (now - q->sent >= RETRANSMIT) {
+          q->sent = now;
+          transmit(ncp, c, &q->pkt);
+        }
+      }
+      if (c->state == OPEN && c->pkn_read != c->ack_sent)
+        send_sts(ncp, c);
+    }
+    if (ncp->exiting && wants_input(c))
+      client_read(ncp, c);
+    if (ncp->exiting)
+      finish(ncp, c);
+    if (c->out_len > 0 || c->shut == 1)
+      client_flush(ncp, c);
+    reap(ncp, c);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef NCP_H
+#define NCP_H
+
+/* In-process Chaosnet NCP.
+
+   This speaks the same Unix socket protocols as the NCP in cbridge
+   to its clients, and the Chaosnet host-to-host protocol to the
+   network.  What the network is depends on the user: it can be UDP
+   to a bridge, or a simulated network. */
+
+#include <poll.h>
+#include <sys/types.h>
+
+#define NCP_MAX_CONN 256
+
+/* Size of a Chaos packet header, and the trailer with hardware
+   addresses and checksum.  CHAOS_MAX_DATA is in chaos.h. */
+#define CHAOS_HEADER  16
+#define CHAOS_TRAILER 6
+#define CHAOS_MAX_WIRE (CHAOS_HEADER + CHAOS_MAX_DATA + CHAOS_TRAILER)
+
+struct ncp;
+
+/* Called to send a packet in wire format to the network. */
+typedef void ncp_transmit_t(void *arg, unsigned dest,
+                            const unsigned char *packet, size_t len);
+
+/* Called when an RFC from src arrives for a contact on dest nobody
+   listens to.  The user may call ncp_listen or ncp_serve and return
+   nonzero to have the RFC delivered to the new listener. */
+typedef int ncp_contact_t(void *arg, struct ncp *ncp, unsigned dest,
+                          unsigned src, const char *contact,
+                          const char *args);
+
+struct ncp *ncp_new(unsigned address, ncp_transmit_t *transmit, void *arg);
+void ncp_free(struct ncp *ncp);
+void ncp_window(struct ncp *ncp, int window);
+void ncp_any_address(struct ncp *ncp, ncp_contact_t *hook);
+int ncp_client(struct ncp *ncp, int fd, int packet);
+int ncp_listen(struct ncp *ncp, int fd, int packet, const char *contact);
+int ncp_serve(struct ncp *ncp, int fd, const char *contact);
+void ncp_receive(struct ncp *ncp, const unsigned char *packet, size_t len);
+int ncp_pollfds(struct ncp *ncp, struct pollfd *pfd, int max);
+void ncp_events(struct ncp *ncp, const struct pollfd *pfd, int n);
+int ncp_timeout(struct ncp *ncp);
+void ncp_timers(struct ncp *ncp);
+void ncp_shutdown(struct ncp *ncp);
+int ncp_connections(struct ncp *ncp);
+
+int chaos_packet_decode(const unsigned char *wire, size_t len, int *opcode,
+                        unsigned *dest, unsigned *src,
+                        const unsigned char **data, size_t *n);
+
+#endif /* NCP_H */
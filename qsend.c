@@ -1,6 +1,7 @@
 /* Copyright © 2024 Lars Brinkoff <lars@nocrew.org> */
 
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -56,14 +57,15 @@ static void header(int fd, char *sender, char *timestamp)
 
 static void usage(char *name)
 {
-  fprintf(stderr, "Usage: %s <user>@<host> [<sender>@<host> [<time>]]\n",
-          name);
+  fprintf(stderr, "Usage: %s <user>@<host>[,<host>...] "
+          "[<sender>@<host> [<time>]]\n", name);
   exit(1);
 }
 
 int main(int argc, char **argv)
 {
   char *user, *host;
+  const char *hosts[CHAOS_MAX_HOSTS + 1];
   char *sender = NULL;
   char *timestamp = NULL;
   int fd;
@@ -85,8 +87,17 @@ int main(int argc, char **argv)
   if (argc > 3)
     timestamp = argv[3];
 
-  fd = chaos_stream();
-  chaos_stream_rfc_data(fd, host, contact, user, strlen(user));
+  if (chaos_host_list(host, hosts, CHAOS_MAX_HOSTS + 1) < 0) {
+    fprintf(stderr, "More than %d hosts\n", CHAOS_MAX_HOSTS);
+    exit(1);
+  }
+  fd = chaos_stream_rfc_any(hosts, contact, user, strlen(user), -1,
+                            CHAOS_RFC_STAGGER, NULL);
+  if (fd < 0) {
+    fprintf(stderr, "Error sending message to %s: %s\n",
+            user, strerror(errno));
+    exit(1);
+  }
 
   header(fd, sender, timestamp);
 
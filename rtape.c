@@ -37,6 +37,7 @@
 #include <sys/errno.h>
 
 #include "chaos.h"
+#include "chaos-probe.h"
 #include "tape-image.h"
 
 #define MAX_RECORD  65536  /* Max size of a tape record we handle. */
@@ -111,11 +112,12 @@
 
 // default window size
 static int winsize = 15;
+// number of outstanding listeners
+static int listeners = 4;
 
+static unsigned char command_header[3];
 static unsigned char command_data[MAX_RECORD + 3];
-static int command_opcode;
-static int command_len;
-static unsigned char *command_ptr;
+static int command_have;  /* Bytes of header and data read so far. */
 static int flags;
 static int allow_slash = 0;
 static int daemonize = 0;
@@ -143,11 +145,8 @@ static handler_t packet_dat;
 
 static handler_t state_ignore;
 static handler_t state_version;
-static handler_t state_opcode;
-static handler_t state_len1;
-static handler_t state_len2;
-static handler_t state_data;
 static handler_t *state;
+static int commands;  /* Version checked, commands follow. */
 
 static handler_t cmd_login;
 static handler_t cmd_mount;
@@ -191,6 +190,8 @@ struct handler command_handler[] = {
 
 static FILE *log, *debug;
 static int sock = -1;
+static struct chaos_conn conn;
+static struct chaos_listener listener;
 static int tape;
 
 static char mounted_drive[MAX_DRIVE_LEN+1];
@@ -216,7 +217,7 @@ static void fatal_error(const char *message)
 
 static void send_packet(int opcode, const void *data, size_t len)
 {
-  if (chaos_packet_send(sock, opcode, data, len) < 0)
+  if (chaos_conn_send(&conn, opcode, data, len) < 0)
     fatal_error("Network send error");
 }
 
@@ -225,12 +226,15 @@ static void packet_rfc(const unsigned char *data, int len)
   if (fork())
     serve();
   else {
+    chaos_listener_close(&listener);
     char tbuf[128];
     time_t now = time(NULL);
     strftime(tbuf, sizeof(tbuf), "%T", localtime(&now));
     strncpy(peer, (const char *)data, len);
     fprintf(log, "%s: Open connection from %s\n", tbuf, peer);
     state = state_version;
+    commands = 0;
+    command_have = 0;
     flags = 0;
     tape = -1;
     send_packet(CHOP_OPN, NULL, 0);
@@ -281,67 +285,78 @@ static void state_version(const unsigned char *data, int len)
 
   fprintf(debug, "Record stream version ok\n");
   send_packet(CHOP_DAT, version, strlen(version));
-  state = state_opcode;
-}
-
-static void state_opcode(const unsigned char *data, int len)
-{
-  command_opcode = data[0];
-  state = state_len1;
-  if (len > 1)
-    state(data + 1, len - 1);
-}
-
-static void state_len1(const unsigned char *data, int len)
-{
-  command_len = (int)data[0] << 8;
-  state = state_len2;
-  if (len > 1)
-    state(data + 1, len - 1);
-}
+  state = state_ignore;
+  commands = 1;
+}
+
+/* Read the next command and dispatch it.  A command may be split
+   by other packets, so what has been read of it is kept for the next
+   call.  Returns 0 if there's a packet other than data to handle
+   first. */
+static int receive_command(void)
+{
+  ssize_t n;
+  int len;
+
+  if (command_have < 3) {
+    n = chaos_conn_read(&conn, command_header + command_have,
+                        3 - command_have, -1);
+    if (n < 0)
+      fatal_error("Connection error");
+    command_have += n;
+    if (command_have < 3)
+      return 0;
+  }
 
-static void state_len2(const unsigned char *data, int len)
-{
-  command_len |= data[0];
-  state = state_data;
-  command_ptr = command_data;
-  state(data + 1, len - 1);
-}
+  len = (command_header[1] << 8) | command_header[2];
+  n = chaos_conn_read(&conn, command_data + command_have - 3,
+                      len - (command_have - 3), -1);
+  if (n < 0)
+    fatal_error("Connection error");
+  command_have += n;
+  if (command_have < 3 + len)
+    return 0;
 
-static void state_data(const unsigned char *data, int len)
-{
-  int n = MIN(len, command_len - (command_ptr - command_data));
-  memcpy(command_ptr, data, n);
-  command_ptr += n;
-  if (command_ptr - command_data == command_len) {
-    dispatch(command_opcode, MAX_COMMANDS, command_handler,
-             command_data, command_len);
-    state = state_opcode;
-    data += n;
-    len -= n;
-    if (len > 0)
-      state(data, len);
-  }
+  command_have = 0;
+  CHAOS_PROBE3(command__start, sock, command_header[0], len);
+  dispatch(command_header[0], MAX_COMMANDS, command_handler,
+           command_data, len);
+  CHAOS_PROBE2(command__done, sock, command_header[0]);
+  return 1;
 }
 
+/* Send a reply as whole data packets, as many at a time as the
+   window has room for. */
 static void send_command(int command, const void *data, size_t len)
 {
-  char buf[MAX_PACKET];
-  const char *p;
-  size_t n;
-
-  buf[0] = command;
-  buf[1] = (len >> 8) & 0xFF;
-  buf[2] = len & 0xFF;
-  n = MIN(len, 450);
-  if (n > 0)
-    memcpy(buf + 3, data, n);
-  len -= n;
-  send_packet(CHOP_DAT, buf, n + 3);
-
-  for (p = (const char *)data + n; len > 0; p += n, len -= n) {
-    n = MIN(len, 450);
-    send_packet(CHOP_DAT, p, n);
+  unsigned char header[3];
+  struct iovec iov[2];
+  size_t done = 0, total = len + 3, n, m;
+  int window, i;
+
+  header[0] = command;
+  header[1] = (len >> 8) & 0xFF;
+  header[2] = len & 0xFF;
+  while (done < total) {
+    /* With commands piling up unread, the window can't be learned,
+       so go on a packet at a time. */
+    window = chaos_conn_wait_window(&conn, -1);
+    if (window < 0)
+      fatal_error("Network error");
+    n = MIN(total - done, (size_t)(window > 0 ? window : 1) * CHAOS_MAX_DATA);
+    i = 0;
+    if (done < 3) {
+      iov[i].iov_base = header + done;
+      iov[i++].iov_len = MIN(n, 3 - done);
+    }
+    m = done + n > 3 ? done + n - 3 : 0;
+    if (m > 0) {
+      iov[i].iov_base = (char *)data + (done > 3 ? done - 3 : 0);
+      iov[i++].iov_len = m - (done > 3 ? done - 3 : 0);
+    }
+    if (chaos_conn_send_message(&conn, CHOP_DAT, iov, i) < 0)
+      fatal_error("Network send error");
+    done += n;
   }
 }
 
@@ -502,17 +517,11 @@ static int number(const unsigned char *data, int len)
   return atoi(parse(&p));
 }
 
-static void millisleep(int ms)
-{
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000000;
-  nanosleep(&ts, NULL);
-}
-
 static int pending(void)
 {
   int n;
+  if (chaos_conn_buffered(&conn) > 0)
+    return 1;
   if (ioctl(sock, FIONREAD, &n) < 0)
     perror("ioctl(FIONREAD)");
   return n > 0;
@@ -542,6 +551,7 @@ static void cmd_read(const unsigned char *data, int len)
       return;
 
     n = read_record(tape, buf, sizeof buf);
+    CHAOS_PROBE2(record__read, sock, n);
     if (n == RECORD_MARK) {
       fprintf(debug, "Peer %s: Read mark\n", peer);
       flags |= FLG_EOF | was_mark;
@@ -559,7 +569,6 @@ static void cmd_read(const unsigned char *data, int len)
       fprintf(debug, "Peer %s: Read record: %d octets\n", peer, (int)n);
       was_mark = 0;
       send_command(CMD_DTA, buf, n);
-      millisleep(100);
     }
   }
 }
@@ -573,6 +582,7 @@ static void cmd_write(const unsigned char *data, int len)
   fprintf(debug, "Peer %s: Write record: %d octets\n", peer, len);
   flags &= ~(FLG_BOT | FLG_EOT | FLG_EOF | FLG_HER | FLG_SER);
   write_record(tape, data, len);
+  CHAOS_PROBE2(record__write, sock, len);
 }
 
 static void space_file(void)
@@ -687,6 +697,8 @@ static void cmd_close(const unsigned char *data, int len)
     ; /* Don't rewind; not applicable. */
   }
   send_packet(CHOP_CLS, NULL, 0);
+  fflush(log);
+  chaos_stats_dump(fileno(log), &conn);
   if (*peer)
     exit(0);
   else
@@ -695,9 +707,13 @@ static void cmd_close(const unsigned char *data, int len)
 
 static void
 handle_packet(void) {
-  unsigned char buf[MAX_PACKET];
+  const unsigned char *buf;
   int opcode;
-  ssize_t n = chaos_packet_recv(sock, &opcode, buf);
+  ssize_t n;
+
+  if (commands && receive_command())
+    return;
+  n = chaos_conn_next(&conn, &opcode, &buf);
   if (n == -1)
     fatal_error("Connection error");
   else if (n == 0)
@@ -710,22 +726,27 @@ static void serve(void)
 {
   close(sock);
   *peer = 0;
-  sock = chaos_packets();
+  do
+    sock = chaos_listener_accept(&listener, &conn);
+  while (sock < 0 && errno == ECONNRESET);
   if (sock < 0) {
     fprintf(stderr, "Error connecting to Chaosnet packet NCP.\n");
     exit(1);
   }
+  /* Pace by our own window until an STS gives the far end's, in case
+     the NCP never sends one. */
+  chaos_conn_window(&conn, winsize);
   state = state_ignore;
-  char cwa[488];
-  sprintf(cwa, "[winsize=%d] %s", winsize, contact);
-  send_packet(CHOP_LSN, cwa, strlen(cwa));
-}  
+  commands = 0;
+  command_have = 0;
+}
 
 static void usage(char *s)
 {
-  fprintf(stderr, "Usage: %s [-adqrv]\n", s);
+  fprintf(stderr, "Usage: %s [-adqrv] [-l N] [-w N]\n", s);
   fprintf(stderr, "  -a    Allow slashes in mount drive name.\n");
   fprintf(stderr, "  -d    Run as daemon.\n");
+  fprintf(stderr, "  -l N  Keep N listeners for incoming connections.\n");
   fprintf(stderr, "  -q    Quiet operation - no logging, just errors.\n");
   fprintf(stderr, "  -r    Only allow read-only mounts.\n");
   fprintf(stderr, "  -v    Verbose operation - detailed logging.\n");
@@ -744,7 +765,7 @@ main(int argc, char *argv[])
   log = stderr;
   debug = stderr;
 
-  while ((c = getopt(argc, argv, "adqrvw:")) != -1) {
+  while ((c = getopt(argc, argv, "adl:qrvw:")) != -1) {
     switch (c) {
     case 'a':
       allow_slash = 1;
@@ -752,6 +773,13 @@ main(int argc, char *argv[])
     case 'd':
       daemonize = 1;
       break;
+    case 'l':
+      listeners = atoi(optarg);
+      if (listeners < 1 || listeners > CHAOS_MAX_LISTEN) {
+	fprintf(stderr,"Bad number of listeners %s\n", optarg);
+	usage(pname);
+      }
+      break;
     case 'q':
       quiet = 1;
       break;
@@ -794,6 +822,10 @@ main(int argc, char *argv[])
 #endif
   }
 
+  if (chaos_listener_init(&listener, contact, winsize, listeners) < 0) {
+    fprintf(stderr, "Error connecting to Chaosnet packet NCP.\n");
+    exit(1);
+  }
   serve();
   for (;;)
     handle_packet();
@@ -31,9 +31,12 @@
 #include <sys/errno.h>
 
 #include "chaos.h"
+#include "chaos-probe.h"
 
 // default window size
 static int winsize = 15;
+// number of outstanding listeners
+static int listeners = 4;
 
 static int daemonize = 0;
 static char peer[MAX_PACKET];
@@ -52,7 +55,6 @@ typedef void handler_t(const unsigned char *data, int len);
 static handler_t packet_rfc;
 static handler_t packet_los;
 static handler_t packet_cls;
-static handler_t packet_dat;
 
 struct handler {
   int opcode;
@@ -62,14 +64,15 @@ struct handler {
 struct handler packet_handler[] = {
   { CHOP_RFC, packet_rfc },
   { CHOP_LOS, packet_los },
-  { CHOP_CLS, packet_cls },
-  { CHOP_DAT, packet_dat }
+  { CHOP_CLS, packet_cls }
 };
 
 #define MAX_HANDLERS (sizeof packet_handler / sizeof packet_handler[0])
 
 static FILE *log, *debug;
 static int sock = -1;
+static struct chaos_conn conn;
+static struct chaos_listener listener;
 
 static void dispatch(int opcode, int n, struct handler *handler,
                      const unsigned char *data, int len)
@@ -87,7 +90,8 @@ static void dispatch(int opcode, int n, struct handler *handler,
 
 static void close_connection(const char *message)
 {
-  pclose(qsend_file);
+  if (qsend_file != NULL)
+    pclose(qsend_file);
   qsend_file = NULL;
 
   char tbuf[128];
@@ -95,7 +99,10 @@ static void close_connection(const char *message)
   strftime(tbuf, sizeof(tbuf), "%T", localtime(&now));
 
   fprintf(log, "%s: Closing peer %s: %s\n", tbuf, peer, message);
+  CHAOS_PROBE2(connection__close, sock, message);
   send_packet(CHOP_CLS, message, strlen(message));
+  fflush(log);
+  chaos_stats_dump(fileno(log), &conn);
   if (*peer)
     exit(0);
   else
@@ -105,7 +112,7 @@ static void close_connection(const char *message)
 
 static void send_packet(int opcode, const void *data, size_t len)
 {
-  if (chaos_packet_send(sock, opcode, data, len) < 0)
+  if (chaos_conn_send(&conn, opcode, data, len) < 0)
     close_connection("Network send error");
 }
 
@@ -117,6 +124,7 @@ static void packet_rfc(const unsigned char *data, int len)
   if (fork())
     serve();
   else {
+    chaos_listener_close(&listener);
     char tbuf[128];
     time_t now = time(NULL);
     strftime(tbuf, sizeof(tbuf), "%T", localtime(&now));
@@ -129,6 +137,7 @@ static void packet_rfc(const unsigned char *data, int len)
       user = "";
 
     fprintf(log, "%s: Open connection from %s\n", tbuf, peer);
+    CHAOS_PROBE3(connection__open, sock, peer, user);
     send_packet(CHOP_OPN, NULL, 0);
 
     snprintf(command, sizeof command, "\'%s\' \'%s\' \'%s'",
@@ -160,22 +169,34 @@ static void packet_cls(const unsigned char *data, int len)
   close_connection(buf);
 }
 
-static void packet_dat(const unsigned char *data, int len)
+/* Copy a line of the message to the handler, converting the Lisp
+   Machine newline.  All data packets are read this way.  Returns 0
+   if there's a packet other than data to handle first. */
+static int receive_line(void)
 {
-  int i;
-  for (i = 0; i < len; i++) {
-    if (data[i] == 0215)
-      fputc('\n', qsend_file);
-    else
-      fputc(data[i], qsend_file);
-  }
+  unsigned char line[1024];
+  ssize_t n;
+
+  n = chaos_conn_read(&conn, line, sizeof line, 0215);
+  if (n < 0)
+    close_connection("Connection error");
+  if (n <= 0)
+    return 0;
+  if (line[n - 1] == 0215)
+    line[n - 1] = '\n';
+  fwrite(line, 1, n, qsend_file);
+  return 1;
 }
 
 static void
 handle_packet(void) {
-  unsigned char buf[MAX_PACKET];
+  const unsigned char *buf;
   int opcode;
-  ssize_t n = chaos_packet_recv(sock, &opcode, buf);
+  ssize_t n;
+
+  if (qsend_file != NULL && receive_line())
+    return;
+  n = chaos_conn_next(&conn, &opcode, &buf);
   if (n == -1)
     close_connection("Connection error");
   else if (n == 0)
@@ -188,20 +209,20 @@ static void serve(void)
 {
   close(sock);
   *peer = 0;
-  sock = chaos_packets();
+  do
+    sock = chaos_listener_accept(&listener, &conn);
+  while (sock < 0 && errno == ECONNRESET);
   if (sock < 0) {
     fprintf(stderr, "Error connecting to Chaosnet packet NCP.\n");
     exit(1);
   }
-  char cwa[MAX_PACKET];
-  int n = sprintf(cwa, "[winsize=%d] %s", winsize, contact);
-  send_packet(CHOP_LSN, cwa, n);
-}  
+}
 
 static void usage(char *s)
 {
-  fprintf(stderr, "Usage: %s [-dqv]\n", s);
+  fprintf(stderr, "Usage: %s [-dqv] [-l N]\n", s);
   fprintf(stderr, "  -d    Run as daemon.\n");
+  fprintf(stderr, "  -l N  Keep N listeners for incoming connections.\n");
   fprintf(stderr, "  -q    Quiet operation - no logging, just errors.\n");
   fprintf(stderr, "  -v    Verbose operation - detailed logging.\n");
   exit(1);
@@ -222,11 +243,18 @@ main(int argc, char *argv[])
   log = stderr;
   debug = stderr;
 
-  while ((c = getopt(argc, argv, "dqv")) != -1) {
+  while ((c = getopt(argc, argv, "dl:qv")) != -1) {
     switch (c) {
     case 'd':
       daemonize = 1;
       break;
+    case 'l':
+      listeners = atoi(optarg);
+      if (listeners < 1 || listeners > CHAOS_MAX_LISTEN) {
+        fprintf(stderr, "Bad number of listeners %s\n", optarg);
+        usage(pname);
+      }
+      break;
     case 'q':
       quiet = 1;
       break;
@@ -259,6 +287,10 @@ main(int argc, char *argv[])
 #endif
   }
 
+  if (chaos_listener_init(&listener, contact, winsize, listeners) < 0) {
+    fprintf(stderr, "Error connecting to Chaosnet packet NCP.\n");
+    exit(1);
+  }
   serve();
   for (;;)
     handle_packet();
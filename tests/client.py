@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Clients for the smoke tests, talking to gw over TCP or to the
+simulator's chaos_stream socket.
+
+  client.py echo PORT BYTES   Send, shut down writing, expect it back.
+  client.py hang PORT SECONDS Expect the gateway to give up in time.
+  client.py listen CONTACT    Take RFCs to CONTACT and never answer.
+  client.py rtape             Write records to rtape and read them back.
+"""
+
+import os
+import socket
+import sys
+import time
+
+# rtape commands, as in rtape.c.
+CMD_MNT, CMD_RD, CMD_WRT, CMD_RWD, CMD_DTA = 2, 4, 5, 6, 34
+
+
+def stream():
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(os.path.join(os.environ.get("CHAOS_SOCKET_DIRECTORY", "/tmp"),
+                           "chaos_stream"))
+    s.settimeout(20)
+    return s
+
+
+def echo(port, n):
+    s = socket.create_connection(("127.0.0.1", port), timeout=20)
+    data = bytes(i % 251 for i in range(n))
+    s.sendall(data)
+    s.shutdown(socket.SHUT_WR)
+    got = b""
+    while True:
+        x = s.recv(65536)
+        if not x:
+            break
+        got += x
+    if got != data:
+        sys.exit("sent %d bytes, got %d back" % (n, len(got)))
+
+
+def hang(port, seconds):
+    s = socket.create_connection(("127.0.0.1", port), timeout=seconds + 5)
+    start = time.time()
+    try:
+        x = s.recv(100)
+    except ConnectionResetError:
+        x = b""
+    took = time.time() - start
+    if x or not seconds - 0.5 < took < seconds + 2:
+        sys.exit("closed after %.1f seconds with %r" % (took, x))
+
+
+def listen(contact):
+    s = stream()
+    s.settimeout(None)
+    s.sendall(b"LSN %s\r\n" % contact.encode())
+    while s.recv(100):
+        pass
+
+
+def rtape():
+    s = stream()
+    buf = b""
+
+    def need(n):
+        nonlocal buf
+        while len(buf) < n:
+            x = s.recv(65536)
+            if not x:
+                sys.exit("closed with %d of %d bytes" % (len(buf), n))
+            buf += x
+        r, buf = buf[:n], buf[n:]
+        return r
+
+    def command(op, data=b"", pieces=1):
+        m = bytes([op, len(data) >> 8, len(data) & 255]) + data
+        step = len(m) // pieces + 1
+        for i in range(0, len(m), step):
+            s.sendall(m[i:i + step])
+            time.sleep(0.05)
+
+    s.sendall(b"RFC 401 RTAPE\r\n")
+    line = b""
+    while not line.endswith(b"\n"):
+        line += s.recv(1)
+    if not line.startswith(b"OPN"):
+        sys.exit("RFC answered %r" % line)
+    version = b"RECORD STREAM VERSION 1\215"
+    s.sendall(version)
+    if need(len(version)) != version:
+        sys.exit("bad version")
+    # Records around the packet size, one bigger than the window, and
+    # one sent in pieces so that a command arrives split.
+    sizes = [1, 5000, 60000, 487, 488, 489]
+    records = [bytes((i * 7 + j) % 256 for j in range(n))
+               for i, n in enumerate(sizes)]
+    command(CMD_MNT, b"BOTH X smoke.tap 0 1600")
+    for i, r in enumerate(records):
+        command(CMD_WRT, r, 5 if i == 1 else 1)
+    command(CMD_RWD)
+    command(CMD_RD, str(len(records)).encode())
+    for r in records:
+        h = need(3)
+        data = need((h[1] << 8) | h[2])
+        if h[0] != CMD_DTA or data != r:
+            sys.exit("read back opcode %d, %d bytes for %d"
+                     % (h[0], len(data), len(r)))
+
+
+def main():
+    what = sys.argv[1]
+    if what == "echo":
+        echo(int(sys.argv[2]), int(sys.argv[3]))
+    elif what == "hang":
+        hang(int(sys.argv[2]), float(sys.argv[3]))
+    elif what == "listen":
+        listen(sys.argv[2])
+    elif what == "rtape":
+        rtape()
+    else:
+        sys.exit(__doc__)
+
+
+main()
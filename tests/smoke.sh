@@ -0,0 +1,97 @@
+#!/bin/sh
+
+# Smoke tests against chaos-sim: gw forwarding and half-close, the
+# RFC deadline, the host name cache, and rtape command framing.  Run
+# from the top directory after make, or with make check.
+
+TOP=$(pwd)
+PORT=${PORT:-19400}
+DIR=$(mktemp -d)
+PIDS=
+FAILED=0
+
+export CHAOS_SOCKET_DIRECTORY="$DIR"
+export CHAOS_HOST_CACHE="$DIR/cache"
+export CHAOS_HOSTS="$DIR/no-hosts"
+export CHAOS_HOSTAB=401
+
+cleanup() {
+    kill $PIDS 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+start() {
+    "$@" >>"$DIR/log" 2>&1 &
+    PIDS="$PIDS $!"
+}
+
+check() {
+    name="$1"
+    shift
+    if "$@" >>"$DIR/log" 2>&1; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        FAILED=1
+    fi
+}
+
+client() {
+    python3 "$TOP/tests/client.py" "$@"
+}
+
+lookups() {
+    test "$(wc -l <"$DIR/hostab" 2>/dev/null || echo 0)" -eq "$1"
+}
+
+# Reread gw's configuration, which looks up the host names again.
+reload() {
+    kill -HUP $GW
+    sleep 0.5
+}
+
+start "$TOP/chaos-sim" -s "$DIR" -c ECHO=cat \
+    -c "HOSTAB=read name; echo \$name >>$DIR/hostab; printf 'CHAOS 404\r\n\r\n'"
+while test \! -S "$DIR/chaos_stream"; do
+    sleep 0.1
+done
+start sh -c "cd '$DIR' && exec '$TOP/rtape' -q"
+start client listen SLOW
+
+cat >"$DIR/gw.conf" <<CONF
+$PORT ECHO 404
+$((PORT + 1)) SLOW 404 timeout=1
+$((PORT + 2)) ECHO foo
+CONF
+start "$TOP/gw" -f "$DIR/gw.conf"
+GW=$!
+sleep 0.5
+
+check "gw forward" client echo $PORT 300000
+check "gw half-close, small" client echo $PORT 10
+check "gw half-close, nothing" client echo $PORT 0
+check "gw RFC deadline" client hang $((PORT + 1)) 1
+
+check "HOSTAB lookup" client echo $((PORT + 2)) 1000
+check "HOSTAB asked once" lookups 1
+reload
+check "HOSTAB cached" lookups 1
+chmod 666 "$DIR/cache"
+reload
+check "writable cache refused" lookups 2
+rm "$DIR/cache"
+echo "foo 405 9999999999" >"$DIR/other"
+ln -s "$DIR/other" "$DIR/cache"
+reload
+check "symlinked cache refused" lookups 3
+check "HOSTAB still answers" client echo $((PORT + 2)) 1000
+
+check "rtape framing" client rtape
+
+if test $FAILED -ne 0; then
+    cat "$DIR/log"
+    exit 1
+fi